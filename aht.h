@@ -15,6 +15,7 @@
 #define u_int8_t unsigned char
 #define u_int16_t unsigned short
 #define u_int32_t unsigned int
+#define u_int64_t unsigned long long
 #endif
 #endif
 
@@ -76,6 +77,9 @@ u_int32_t trivial_hash(unsigned char *buf, size_t len);
 u_int32_t trivial_hashR(unsigned char *buf, size_t len);
 u_int32_t ht_strong_hash(u_int8_t *k, u_int32_t length, u_int32_t initval);
 u_int32_t __ht_strong_hash(u_int8_t *k, u_int32_t length, u_int32_t initval);
+u_int32_t ht_fast_hash(u_int8_t *k, u_int32_t length, u_int32_t initval);
+u_int64_t __ht_fast_hash(const u_int8_t *p, size_t len, u_int64_t seed);
+void ht_set_strong_hash_init_val(u_int32_t secret);
 
 /* ----------------- hash functions for common data types ------------------- */
 u_int32_t ht_hash_string(void *key);
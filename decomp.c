@@ -0,0 +1,619 @@
+/* Streaming decompression of compressed log files.
+ *
+ * Copyright (C) 2012 Camilo E. Hidalgo Estevez <camiloehe@gmail.com>
+ * All Rights Reserved.
+ *
+ * This software is released under the terms of the BSD license.
+ * Read the COPYING file in this distribution for more details.
+ *
+ * Rotated logs are usually compressed with gzip, xz or zstd. This module
+ * detects the format by magic bytes and decompresses the file in blocks
+ * so that the caller can split the output in lines as if it was read
+ * from a plain file. Every library is optional, see the Makefile.
+ *
+ * While a file is decompressed from the start a seek index can be built
+ * and saved in a sidecar file: it contains access points spread in the
+ * file from where the decompression can be started again (deflate block
+ * boundaries with their 32k window for gzip, frame boundaries for zstd),
+ * so that later runs can decompress different parts of the same file at
+ * the same time. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef VI_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef VI_HAVE_LZMA
+#include <stdint.h>
+#include <lzma.h>
+#endif
+#ifdef VI_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decomp.h"
+
+#ifdef WIN32
+#define fseeko _fseeki64
+#endif
+
+/* Return the compression format of the data starting with the 'len'
+ * bytes at 'p'. VI_COMP_NONE is returned for uncompressed data. */
+int vi_decomp_type(unsigned char *p, size_t len) {
+	if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b)
+		return VI_COMP_GZIP;
+	if (len >= 6 && !memcmp(p, "\xfd" "7zXZ\0", 6))
+		return VI_COMP_XZ;
+	if (len >= 4 && !memcmp(p, "\x28\xb5\x2f\xfd", 4))
+		return VI_COMP_ZSTD;
+	return VI_COMP_NONE;
+}
+
+/* Return the name of the compression format 'type' */
+char *vi_decomp_name(int type) {
+	switch(type) {
+	case VI_COMP_GZIP: return "gzip";
+	case VI_COMP_XZ: return "xz";
+	case VI_COMP_ZSTD: return "zstd";
+	default: return "none";
+	}
+}
+
+#if defined(VI_HAVE_ZLIB) || defined(VI_HAVE_LZMA) || defined(VI_HAVE_ZSTD)
+/* Fill the input buffer with the next block of compressed data.
+ * Returns the number of bytes read, zero at end of file or on error
+ * (in this case the error is set). */
+static size_t vi_decomp_fill(struct vi_decomp *d) {
+	size_t n;
+
+	if (d->eof) return 0;
+	n = fread(d->in, 1, VI_DECOMP_INBUF, d->fp);
+	if (n < VI_DECOMP_INBUF) {
+		d->eof = 1;
+		if (ferror(d->fp))
+			d->error = "Error reading compressed data";
+	}
+	d->inbytes += n;
+	return n;
+}
+#endif
+
+#if defined(VI_HAVE_ZLIB) || defined(VI_HAVE_ZSTD)
+/* Add an access point to the index being built. When the point is too
+ * near to the previous one it is not added, and 1 is returned.
+ * Returns 0 on success, -1 on out of memory (the index is marked as
+ * failed, the decompression can go on). */
+static int vi_decomp_add_point(struct vi_decomp_index *idx, long long out,
+                               long long in) {
+	struct vi_decomp_point *p;
+
+	if (idx->points && out - idx->point[idx->points-1].out < idx->span)
+		return 1;
+	if (idx->points == idx->alloc) {
+		int alloc = idx->alloc ? idx->alloc*2 : 16;
+
+		p = realloc(idx->point, sizeof(*p)*alloc);
+		if (p == NULL) {
+			idx->failed = 1;
+			return -1;
+		}
+		idx->point = p;
+		idx->alloc = alloc;
+	}
+	p = &idx->point[idx->points++];
+	p->out = out;
+	p->in = in;
+	p->bits = 0;
+	p->winlen = 0;
+	p->window = NULL;
+	return 0;
+}
+#endif
+
+/* --------------------------------- gzip ----------------------------------- */
+#ifdef VI_HAVE_ZLIB
+static int vi_gz_open(struct vi_decomp *d) {
+	z_stream *z;
+
+	if ((z = calloc(1, sizeof(*z))) == NULL) return -1;
+	/* 15+32: max window, automatic gzip/zlib header detection.
+	 * -15: raw deflate data, resuming from an access point. */
+	if (inflateInit2(z, d->raw ? -15 : 15+32) != Z_OK) {
+		free(z);
+		return -1;
+	}
+	d->stream = z;
+	return 0;
+}
+
+/* Resume the decompression at the access point 'p', whose block starts
+ * 'p->bits' bits before the byte at 'p->in'. The file must be positioned
+ * at the first byte containing data of the block. */
+static int vi_gz_resume(struct vi_decomp *d, struct vi_decomp_point *p) {
+	z_stream *z = d->stream;
+
+	if (p->bits) {
+		int c = fgetc(d->fp);
+
+		if (c == EOF) return -1;
+		d->inbytes++;
+		inflatePrime(z, p->bits, c >> (8 - p->bits));
+	}
+	if (p->winlen &&
+	    inflateSetDictionary(z, p->window, p->winlen) != Z_OK)
+		return -1;
+	return 0;
+}
+
+/* Called at the end of every deflate block while an index is built:
+ * add an access point with the current window if the previous one is
+ * far enough. 'produced' is the output of the current read so far. */
+static void vi_gz_point(struct vi_decomp *d, long produced) {
+	struct vi_decomp_index *idx = d->index;
+	struct vi_decomp_point *p;
+	z_stream *z = d->stream;
+	uInt winlen = VI_DECOMP_WINSIZE;
+
+	if (vi_decomp_add_point(idx, d->outbytes + produced,
+	                        d->inbytes - z->avail_in) != 0)
+		return;
+	p = &idx->point[idx->points-1];
+	if (p->out == 0) {
+		/* The first block: just start from the gzip header */
+		p->in = 0;
+		return;
+	}
+	p->bits = z->data_type & 7;
+	if ((p->window = malloc(VI_DECOMP_WINSIZE)) == NULL ||
+	    inflateGetDictionary(z, p->window, &winlen) != Z_OK) {
+		idx->failed = 1;
+		return;
+	}
+	p->winlen = winlen;
+}
+
+static long vi_gz_read(struct vi_decomp *d, char *buf, size_t len) {
+	z_stream *z = d->stream;
+	int ret;
+
+	z->next_out = (Bytef*) buf;
+	z->avail_out = len;
+	while (z->avail_out && !d->done) {
+		if (z->avail_in == 0) {
+			z->avail_in = vi_decomp_fill(d);
+			z->next_in = d->in;
+			if (d->error) return -1;
+		}
+		/* Z_BLOCK stops at every block boundary, where an
+		 * access point may be added to the index. */
+		if (d->index && !d->index->failed) {
+			ret = inflate(z, Z_BLOCK);
+			if (ret == Z_OK && (z->data_type & 128) &&
+			    !(z->data_type & 64))
+				vi_gz_point(d, len - z->avail_out);
+		} else {
+			ret = inflate(z, Z_NO_FLUSH);
+		}
+		if (ret == Z_STREAM_END) {
+			/* A gzip file may contain multiple members. The
+			 * raw data of a resumed member ends here. */
+			if (z->avail_in == 0 && !d->raw) {
+				z->avail_in = vi_decomp_fill(d);
+				z->next_in = d->in;
+				if (d->error) return -1;
+			}
+			if (z->avail_in == 0 || d->raw) {
+				d->done = 1;
+			} else {
+				/* Points of the next members would be
+				 * resumed as raw data: not supported. */
+				if (d->index) d->index->failed = 1;
+				inflateReset(z);
+			}
+		} else if (ret == Z_BUF_ERROR) {
+			if (z->avail_in == 0 && d->eof) {
+				d->error = "Unexpected end of gzip data";
+				return -1;
+			}
+		} else if (ret != Z_OK) {
+			d->error = "Corrupted gzip data";
+			return -1;
+		}
+	}
+	return len - z->avail_out;
+}
+
+static void vi_gz_close(struct vi_decomp *d) {
+	inflateEnd(d->stream);
+	free(d->stream);
+}
+#endif
+
+/* ---------------------------------- xz ------------------------------------ */
+#ifdef VI_HAVE_LZMA
+static int vi_xz_open(struct vi_decomp *d) {
+	lzma_stream init = LZMA_STREAM_INIT;
+	lzma_stream *s;
+
+	if ((s = malloc(sizeof(*s))) == NULL) return -1;
+	*s = init;
+	if (lzma_stream_decoder(s, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+		free(s);
+		return -1;
+	}
+	d->stream = s;
+	return 0;
+}
+
+static long vi_xz_read(struct vi_decomp *d, char *buf, size_t len) {
+	lzma_stream *s = d->stream;
+	lzma_ret ret;
+
+	s->next_out = (uint8_t*) buf;
+	s->avail_out = len;
+	while (s->avail_out && !d->done) {
+		if (s->avail_in == 0 && !d->eof) {
+			s->avail_in = vi_decomp_fill(d);
+			s->next_in = d->in;
+			if (d->error) return -1;
+		}
+		/* LZMA_FINISH once all the input is in the buffer */
+		ret = lzma_code(s, d->eof ? LZMA_FINISH : LZMA_RUN);
+		if (ret == LZMA_STREAM_END) {
+			d->done = 1;
+		} else if (ret == LZMA_BUF_ERROR) {
+			d->error = "Unexpected end of xz data";
+			return -1;
+		} else if (ret != LZMA_OK) {
+			d->error = "Corrupted xz data";
+			return -1;
+		}
+	}
+	return len - s->avail_out;
+}
+
+static void vi_xz_close(struct vi_decomp *d) {
+	lzma_end(d->stream);
+	free(d->stream);
+}
+#endif
+
+/* --------------------------------- zstd ----------------------------------- */
+#ifdef VI_HAVE_ZSTD
+struct vi_zstd {
+	ZSTD_DStream *zs;
+	ZSTD_inBuffer in;
+	size_t last;	/* last hint, zero when a frame was completed */
+};
+
+static int vi_zstd_open(struct vi_decomp *d) {
+	struct vi_zstd *z;
+
+	if ((z = calloc(1, sizeof(*z))) == NULL) return -1;
+	if ((z->zs = ZSTD_createDStream()) == NULL) {
+		free(z);
+		return -1;
+	}
+	ZSTD_initDStream(z->zs);
+	z->last = 1;
+	d->stream = z;
+	return 0;
+}
+
+static long vi_zstd_read(struct vi_decomp *d, char *buf, size_t len) {
+	struct vi_zstd *z = d->stream;
+	ZSTD_outBuffer out;
+
+	out.dst = buf;
+	out.size = len;
+	out.pos = 0;
+	if (d->index && d->index->points == 0 && d->outbytes == 0)
+		vi_decomp_add_point(d->index, 0, 0);
+	while (out.pos < out.size && !d->done) {
+		size_t before = out.pos, inpos, ret;
+
+		if (z->in.pos == z->in.size && !d->eof) {
+			z->in.src = d->in;
+			z->in.size = vi_decomp_fill(d);
+			z->in.pos = 0;
+			if (d->error) return -1;
+		}
+		/* Multiple frames are handled by the decoder itself */
+		inpos = z->in.pos;
+		ret = ZSTD_decompressStream(z->zs, &out, &z->in);
+		if (ZSTD_isError(ret)) {
+			d->error = "Corrupted zstd data";
+			return -1;
+		}
+		/* A frame was completed: the next one is an access point */
+		if (ret == 0 && d->index && !d->index->failed)
+			vi_decomp_add_point(d->index, d->outbytes + out.pos,
+			        d->inbytes - (z->in.size - z->in.pos));
+		if (out.pos == before && z->in.pos == inpos && d->eof) {
+			/* No progress and no more input: the data is
+			 * complete only if the last frame was. */
+			if (z->last != 0) {
+				d->error = "Unexpected end of zstd data";
+				return -1;
+			}
+			d->done = 1;
+		} else {
+			z->last = ret;
+		}
+	}
+	return out.pos;
+}
+
+static void vi_zstd_close(struct vi_decomp *d) {
+	struct vi_zstd *z = d->stream;
+
+	ZSTD_freeDStream(z->zs);
+	free(z);
+}
+#endif
+
+/* ---------------------------------- API ----------------------------------- */
+static int vi_decomp_start(struct vi_decomp *d, FILE *fp, int type, int raw) {
+	int retval = -1;
+
+	memset(d, 0, sizeof(*d));
+	d->type = type;
+	d->fp = fp;
+	d->raw = raw;
+	if ((d->in = malloc(VI_DECOMP_INBUF)) == NULL) {
+		d->error = "Out of memory";
+		return -1;
+	}
+	switch(type) {
+#ifdef VI_HAVE_ZLIB
+	case VI_COMP_GZIP: retval = vi_gz_open(d); break;
+#endif
+#ifdef VI_HAVE_LZMA
+	case VI_COMP_XZ: retval = vi_xz_open(d); break;
+#endif
+#ifdef VI_HAVE_ZSTD
+	case VI_COMP_ZSTD: retval = vi_zstd_open(d); break;
+#endif
+	default:
+		d->error = "Support for this compression format is not compiled in";
+		free(d->in);
+		d->in = NULL;
+		return -1;
+	}
+	if (retval == -1) {
+		d->error = "Out of memory";
+		free(d->in);
+		d->in = NULL;
+	}
+	return retval;
+}
+
+/* Start the decompression of the file 'fp', compressed with 'type'.
+ * Returns 0 on success, -1 on error (unsupported format or out of
+ * memory), with the error set in d->error. */
+int vi_decomp_open(struct vi_decomp *d, FILE *fp, int type) {
+	return vi_decomp_start(d, fp, type, 0);
+}
+
+/* Start the decompression of the file 'fp' at the access point number
+ * 'point' of the index 'idx'. The data returned by vi_decomp_read()
+ * starts at the uncompressed offset idx->point[point].out.
+ * Returns 0 on success, -1 on error, with the error set in d->error. */
+int vi_decomp_open_at(struct vi_decomp *d, FILE *fp,
+                      struct vi_decomp_index *idx, int point) {
+	struct vi_decomp_point *p = &idx->point[point];
+	int raw = 0;
+
+	/* At the start of the file the usual decompression is fine, in
+	 * the middle of a gzip member the data is raw deflate. */
+	if (p->out != 0 && idx->type == VI_COMP_GZIP) raw = 1;
+	if (fseeko(fp, p->in - (raw && p->bits ? 1 : 0), SEEK_SET) == -1) {
+		memset(d, 0, sizeof(*d));
+		d->error = "Can't seek in the compressed file";
+		return -1;
+	}
+	if (vi_decomp_start(d, fp, idx->type, raw) == -1) return -1;
+#ifdef VI_HAVE_ZLIB
+	if (raw && vi_gz_resume(d, p) == -1) {
+		d->error = "Invalid access point in the gzip index";
+		vi_decomp_close(d);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* Decompress up to 'len' bytes into 'buf'.
+ * Returns the number of bytes stored, 0 at the end of the data,
+ * or -1 on error (the error is set in d->error). */
+long vi_decomp_read(struct vi_decomp *d, char *buf, size_t len) {
+	long n = -1;
+
+#if !defined(VI_HAVE_ZLIB) && !defined(VI_HAVE_LZMA) && !defined(VI_HAVE_ZSTD)
+	(void) buf; /* no format to decompress */
+	(void) len;
+#endif
+	if (d->done) return 0;
+	switch(d->type) {
+#ifdef VI_HAVE_ZLIB
+	case VI_COMP_GZIP: n = vi_gz_read(d, buf, len); break;
+#endif
+#ifdef VI_HAVE_LZMA
+	case VI_COMP_XZ: n = vi_xz_read(d, buf, len); break;
+#endif
+#ifdef VI_HAVE_ZSTD
+	case VI_COMP_ZSTD: n = vi_zstd_read(d, buf, len); break;
+#endif
+	}
+	if (n > 0) d->outbytes += n;
+	if (d->done && d->index) {
+		struct vi_decomp_index *idx = d->index;
+
+		/* Drop the points at the very end, like the start of the
+		 * frame that would follow the last zstd one. */
+		idx->outsize = d->outbytes;
+		while (idx->points > 1 &&
+		       idx->point[idx->points-1].out >= idx->outsize)
+			free(idx->point[--idx->points].window);
+	}
+	return n;
+}
+
+/* Release the resources of the decompressor. The input file is not
+ * closed, as it was opened by the caller. */
+void vi_decomp_close(struct vi_decomp *d) {
+	if (d->in == NULL) return; /* not opened */
+	switch(d->type) {
+#ifdef VI_HAVE_ZLIB
+	case VI_COMP_GZIP: vi_gz_close(d); break;
+#endif
+#ifdef VI_HAVE_LZMA
+	case VI_COMP_XZ: vi_xz_close(d); break;
+#endif
+#ifdef VI_HAVE_ZSTD
+	case VI_COMP_ZSTD: vi_zstd_close(d); break;
+#endif
+	}
+	free(d->in);
+	d->in = NULL;
+}
+
+/* ------------------------------- seek index ------------------------------- */
+/* The sidecar file is a cache of the index: it is written in the native
+ * byte order, and it is valid only for a compressed file with the same
+ * format, size and modification time. Format:
+ *
+ * "VIDX" version(int) type(int) size mtime span outsize points(int)
+ * and for every point: out in bits(int) winlen(int) window[winlen]
+ *
+ * where the fields not otherwise specified are long long. */
+#define VI_DECOMP_INDEX_MAGIC "VIDX"
+#define VI_DECOMP_INDEX_VERSION 1
+
+/* Initialize an empty index for a file compressed with 'type' of 'size'
+ * bytes modified at 'mtime'. Access points are added while the file is
+ * decompressed at least every 'span' uncompressed bytes, setting the
+ * index in the 'index' field of the decompressor. */
+void vi_decomp_index_init(struct vi_decomp_index *idx, int type,
+                          long long size, long long mtime, long long span) {
+	memset(idx, 0, sizeof(*idx));
+	idx->type = type;
+	idx->size = size;
+	idx->mtime = mtime;
+	idx->span = span;
+	/* The xz format has no access points we can use */
+	idx->failed = type != VI_COMP_GZIP && type != VI_COMP_ZSTD;
+}
+
+void vi_decomp_index_free(struct vi_decomp_index *idx) {
+	int i;
+
+	for (i = 0; i < idx->points; i++)
+		free(idx->point[i].window);
+	free(idx->point);
+	idx->point = NULL;
+	idx->points = idx->alloc = 0;
+}
+
+/* Load the sidecar file 'filename' in the index 'idx', initialized with
+ * vi_decomp_index_init() for the compressed file it should describe.
+ * Returns 0 on success, -1 if the sidecar does not exist, is stale or
+ * is invalid (the index is left empty). */
+int vi_decomp_index_load(struct vi_decomp_index *idx, char *filename) {
+	char magic[4];
+	int version, type, points, i;
+	long long size, mtime, span, outsize;
+	FILE *fp;
+
+	if (idx->failed || (fp = fopen(filename, "rb")) == NULL) return -1;
+	if (fread(magic, 4, 1, fp) != 1 ||
+	    memcmp(magic, VI_DECOMP_INDEX_MAGIC, 4) ||
+	    fread(&version, sizeof(int), 1, fp) != 1 ||
+	    version != VI_DECOMP_INDEX_VERSION ||
+	    fread(&type, sizeof(int), 1, fp) != 1 ||
+	    fread(&size, sizeof(long long), 1, fp) != 1 ||
+	    fread(&mtime, sizeof(long long), 1, fp) != 1 ||
+	    fread(&span, sizeof(long long), 1, fp) != 1 ||
+	    fread(&outsize, sizeof(long long), 1, fp) != 1 ||
+	    fread(&points, sizeof(int), 1, fp) != 1 ||
+	    type != idx->type || size != idx->size || mtime != idx->mtime ||
+	    points < 1 || points > outsize/(span > 0 ? span : 1)+1)
+		goto err;
+	idx->span = span;
+	idx->outsize = outsize;
+	if ((idx->point = calloc(points, sizeof(*idx->point))) == NULL)
+		goto err;
+	idx->alloc = points;
+	for (i = 0; i < points; i++) {
+		struct vi_decomp_point *p = &idx->point[i];
+
+		idx->points++;
+		if (fread(&p->out, sizeof(long long), 1, fp) != 1 ||
+		    fread(&p->in, sizeof(long long), 1, fp) != 1 ||
+		    fread(&p->bits, sizeof(int), 1, fp) != 1 ||
+		    fread(&p->winlen, sizeof(int), 1, fp) != 1 ||
+		    p->bits < 0 || p->bits > 7 ||
+		    p->winlen < 0 || p->winlen > VI_DECOMP_WINSIZE ||
+		    p->in < 0 || p->in > size || p->out > outsize ||
+		    (i == 0 && p->out != 0) ||
+		    (i > 0 && p->out <= idx->point[i-1].out))
+			goto err;
+		if (p->winlen == 0) continue;
+		if ((p->window = malloc(p->winlen)) == NULL ||
+		    fread(p->window, p->winlen, 1, fp) != 1)
+			goto err;
+	}
+	fclose(fp);
+	return 0;
+
+err:
+	vi_decomp_index_free(idx);
+	fclose(fp);
+	return -1;
+}
+
+/* Save the index 'idx' in the sidecar file 'filename'. The file is
+ * written with a temporary name and renamed, so that a concurrent run
+ * never reads a partial index.
+ * Returns 0 on success, -1 on error. */
+int vi_decomp_index_save(struct vi_decomp_index *idx, char *filename) {
+	int version = VI_DECOMP_INDEX_VERSION, i, err = 0;
+	char *tmp;
+	FILE *fp;
+
+	if (idx->failed || idx->points == 0) return -1;
+	if ((tmp = malloc(strlen(filename)+5)) == NULL) return -1;
+	sprintf(tmp, "%s.tmp", filename);
+	if ((fp = fopen(tmp, "wb")) == NULL) {
+		free(tmp);
+		return -1;
+	}
+	err |= fwrite(VI_DECOMP_INDEX_MAGIC, 4, 1, fp) != 1;
+	err |= fwrite(&version, sizeof(int), 1, fp) != 1;
+	err |= fwrite(&idx->type, sizeof(int), 1, fp) != 1;
+	err |= fwrite(&idx->size, sizeof(long long), 1, fp) != 1;
+	err |= fwrite(&idx->mtime, sizeof(long long), 1, fp) != 1;
+	err |= fwrite(&idx->span, sizeof(long long), 1, fp) != 1;
+	err |= fwrite(&idx->outsize, sizeof(long long), 1, fp) != 1;
+	err |= fwrite(&idx->points, sizeof(int), 1, fp) != 1;
+	for (i = 0; i < idx->points; i++) {
+		struct vi_decomp_point *p = &idx->point[i];
+
+		err |= fwrite(&p->out, sizeof(long long), 1, fp) != 1;
+		err |= fwrite(&p->in, sizeof(long long), 1, fp) != 1;
+		err |= fwrite(&p->bits, sizeof(int), 1, fp) != 1;
+		err |= fwrite(&p->winlen, sizeof(int), 1, fp) != 1;
+		if (p->winlen)
+			err |= fwrite(p->window, p->winlen, 1, fp) != 1;
+	}
+	err |= fclose(fp) != 0;
+	if (err || rename(tmp, filename) == -1) {
+		remove(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
@@ -0,0 +1,81 @@
+/* Streaming decompression of compressed log files.
+ *
+ * Copyright (C) 2012 Camilo E. Hidalgo Estevez <camiloehe@gmail.com>
+ * All Rights Reserved.
+ *
+ * This software is released under the terms of the BSD license.
+ * Read the COPYING file in this distribution for more details. */
+
+#ifndef __VI_DECOMP_H
+#define __VI_DECOMP_H
+
+#include <stdio.h>
+
+/* Compression formats, detected by magic bytes */
+#define VI_COMP_NONE	0
+#define VI_COMP_GZIP	1
+#define VI_COMP_XZ	2
+#define VI_COMP_ZSTD	3
+
+/* Number of bytes needed by vi_decomp_type() to detect every format */
+#define VI_COMP_MAGIC_LEN 6
+
+/* Size of the buffer used to read the compressed input */
+#define VI_DECOMP_INBUF (256*1024)
+
+/* Size of the deflate window saved in gzip access points */
+#define VI_DECOMP_WINSIZE 32768
+
+/* A point where the decompression can start without to decompress what
+ * precedes it: the start of a deflate block, together with the last 32k
+ * of uncompressed data the block may refer to, or the start of a zstd
+ * frame. */
+struct vi_decomp_point {
+	long long out;		/* uncompressed offset */
+	long long in;		/* compressed offset */
+	int bits;		/* bits of the byte before 'in' to use (gzip) */
+	int winlen;		/* length of the window (gzip) */
+	unsigned char *window;
+};
+
+/* Seek index of a compressed file, cached in a sidecar file */
+struct vi_decomp_index {
+	int type;
+	long long size;		/* size and mtime of the compressed file, */
+	long long mtime;	/* used to detect stale indexes */
+	long long span;		/* min uncompressed bytes between points */
+	long long outsize;	/* uncompressed size */
+	int failed;		/* the file can't be indexed */
+	int points;
+	int alloc;
+	struct vi_decomp_point *point;
+};
+
+struct vi_decomp {
+	int type;
+	FILE *fp;		/* compressed input */
+	unsigned char *in;	/* input buffer */
+	void *stream;		/* library specific state */
+	int raw;		/* gzip: raw deflate resumed from a point */
+	int eof;		/* no more compressed input */
+	int done;		/* no more uncompressed output */
+	char *error;		/* last error, static string */
+	long long inbytes;	/* compressed bytes read */
+	long long outbytes;	/* uncompressed bytes returned */
+	struct vi_decomp_index *index;	/* index to build, or NULL */
+};
+
+int vi_decomp_type(unsigned char *p, size_t len);
+char *vi_decomp_name(int type);
+int vi_decomp_open(struct vi_decomp *d, FILE *fp, int type);
+int vi_decomp_open_at(struct vi_decomp *d, FILE *fp,
+                      struct vi_decomp_index *idx, int point);
+long vi_decomp_read(struct vi_decomp *d, char *buf, size_t len);
+void vi_decomp_close(struct vi_decomp *d);
+void vi_decomp_index_init(struct vi_decomp_index *idx, int type,
+                          long long size, long long mtime, long long span);
+void vi_decomp_index_free(struct vi_decomp_index *idx);
+int vi_decomp_index_load(struct vi_decomp_index *idx, char *filename);
+int vi_decomp_index_save(struct vi_decomp_index *idx, char *filename);
+
+#endif /* __VI_DECOMP_H */
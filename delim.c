@@ -0,0 +1,142 @@
+/* Vectorized search of the field delimiters of log lines.
+ *
+ * Copyright (C) 2012 Camilo E. Hidalgo Estevez <camiloehe@gmail.com>
+ * All Rights Reserved.
+ *
+ * This software is released under the terms of the BSD license.
+ * Read the COPYING file in this distribution for more details.
+ *
+ * The fields of a log line are separated by spaces, quotes and square
+ * brackets. Instead of testing the line byte by byte, a window of it is
+ * classified at once into bitmasks, 16 bytes per step with SSE2 or 32
+ * bytes per step with AVX2, and the parser then jumps from a delimiter
+ * to the next one counting the trailing zeros of the masks. The kernel
+ * is selected at run time according to the features of the CPU. Where
+ * SSE2 is not available the masks are not used at all, and delim.h
+ * searches the delimiters byte by byte. */
+
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define VI_HAVE_AVX2
+#include <immintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "delim.h"
+
+typedef void vi_delim_kernel(const char *p, size_t len, vi_mask_t *mask);
+
+/* Set the bits of the delimiters among the 'len' bytes at 'p'. The bits
+ * of 'mask' starting at 'p' must be clear. */
+static void vi_delim_mask_scalar(const char *p, size_t len, vi_mask_t *mask) {
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (vi_is_delim(p[i]))
+			mask[i >> 6] |= (vi_mask_t)1 << (i & 63);
+	}
+}
+
+#ifdef __SSE2__
+static void vi_delim_mask_sse2(const char *p, size_t len, vi_mask_t *mask) {
+	const __m128i sp = _mm_set1_epi8(' '), qt = _mm_set1_epi8('"');
+	const __m128i lb = _mm_set1_epi8('['), rb = _mm_set1_epi8(']');
+	size_t i;
+
+	for (i = 0; i+16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(p+i));
+		__m128i m = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, qt)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, lb), _mm_cmpeq_epi8(v, rb)));
+		mask[i >> 6] |= (vi_mask_t)(unsigned)_mm_movemask_epi8(m) << (i & 63);
+	}
+	/* The tail is tested byte by byte, as reading past the end of the
+	 * line may cross the end of the mapped file. */
+	for (; i < len; i++) {
+		if (vi_is_delim(p[i]))
+			mask[i >> 6] |= (vi_mask_t)1 << (i & 63);
+	}
+}
+#endif
+
+#ifdef VI_HAVE_AVX2
+__attribute__((target("avx2")))
+static void vi_delim_mask_avx2(const char *p, size_t len, vi_mask_t *mask) {
+	const __m256i sp = _mm256_set1_epi8(' '), qt = _mm256_set1_epi8('"');
+	const __m256i lb = _mm256_set1_epi8('['), rb = _mm256_set1_epi8(']');
+	size_t i;
+
+	for (i = 0; i+32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(p+i));
+		__m256i m = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, sp),
+			                _mm256_cmpeq_epi8(v, qt)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, lb),
+			                _mm256_cmpeq_epi8(v, rb)));
+		mask[i >> 6] |= (vi_mask_t)(unsigned)_mm256_movemask_epi8(m)
+		                << (i & 63);
+	}
+	for (; i < len; i++) {
+		if (vi_is_delim(p[i]))
+			mask[i >> 6] |= (vi_mask_t)1 << (i & 63);
+	}
+}
+#endif
+
+#ifdef __SSE2__
+static vi_delim_kernel *vi_delim_kernel_fn = vi_delim_mask_sse2;
+#else
+static vi_delim_kernel *vi_delim_kernel_fn = vi_delim_mask_scalar;
+#endif
+
+/* Select the fastest kernel supported by the CPU. Must be called
+ * before any thread starts to parse lines. */
+void vi_delim_setup(void) {
+#ifdef VI_HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		vi_delim_kernel_fn = vi_delim_mask_avx2;
+		return;
+	}
+#endif
+#ifdef __SSE2__
+	vi_delim_kernel_fn = vi_delim_mask_sse2;
+#else
+	vi_delim_kernel_fn = vi_delim_mask_scalar;
+#endif
+}
+
+/* Return the name of the selected kernel */
+char *vi_delim_kernel_name(void) {
+#ifdef VI_HAVE_AVX2
+	if (vi_delim_kernel_fn == vi_delim_mask_avx2) return "avx2";
+#endif
+#ifdef __SSE2__
+	if (vi_delim_kernel_fn == vi_delim_mask_sse2) return "sse2";
+#endif
+	return "byte by byte";
+}
+
+/* Set the bits of the delimiters among the 'len' bytes at 'p' in the
+ * bitmask 'mask', that must be clear. */
+void vi_delim_mask(const char *p, size_t len, vi_mask_t *mask) {
+	vi_delim_kernel_fn(p, len, mask);
+}
+
+/* Classify the window of the line starting at 'from' */
+void vi_delim_window(struct vi_delim *d, char *from) {
+	size_t len = d->end - from;
+
+	if (len > VI_DELIM_WINDOW) len = VI_DELIM_WINDOW;
+	memset(d->mask, 0, sizeof(d->mask));
+	d->base = from;
+	/* Not worth a vector step */
+	if (len < 16)
+		vi_delim_mask_scalar(from, len, d->mask);
+	else
+		vi_delim_kernel_fn(from, len, d->mask);
+}
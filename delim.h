@@ -0,0 +1,116 @@
+/* Vectorized search of the field delimiters of log lines.
+ *
+ * Copyright (C) 2012 Camilo E. Hidalgo Estevez <camiloehe@gmail.com>
+ * All Rights Reserved.
+ *
+ * This software is released under the terms of the BSD license.
+ * Read the COPYING file in this distribution for more details. */
+
+#ifndef __VI_DELIM_H
+#define __VI_DELIM_H
+
+#include <stddef.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+typedef unsigned __int64 vi_mask_t;
+#else
+typedef unsigned long long vi_mask_t;
+#endif
+
+/* Without SSE2 classifying a window byte by byte costs more than it
+ * saves, so the delimiters are searched directly in the line. */
+#ifdef __SSE2__
+#define VI_DELIM_VECTOR
+#endif
+
+#define vi_is_delim(c) ((c) == ' ' || (c) == '"' || (c) == '[' || (c) == ']')
+
+/* Bytes of the line classified at once. Most lines have every field
+ * the parser needs in the first window, the rest are classified only
+ * when the parser gets there. */
+#define VI_DELIM_WINDOW 256
+#define VI_DELIM_WORDS (VI_DELIM_WINDOW/64)
+
+/* Delimiters of a line: bit 'i' of the window is set if base[i] is one
+ * of ' ', '"', '[' or ']' */
+struct vi_delim {
+	char *base;		/* start of the classified window */
+	char *end;		/* end of the line */
+	vi_mask_t mask[VI_DELIM_WORDS];
+};
+
+void vi_delim_setup(void);
+char *vi_delim_kernel_name(void);
+void vi_delim_mask(const char *p, size_t len, vi_mask_t *mask);
+void vi_delim_window(struct vi_delim *d, char *from);
+
+#if defined(__GNUC__)
+#define vi_delim_ctz(x) __builtin_ctzll(x)
+#else
+static int vi_delim_ctz(vi_mask_t x) {
+	int n = 0;
+
+	while (!(x & 1)) {
+		x >>= 1;
+		n++;
+	}
+	return n;
+}
+#endif
+
+/* Prepare 'd' to search the delimiters of the 'len' bytes line 'l' */
+static inline void vi_delim_init(struct vi_delim *d, char *l, size_t len) {
+	d->base = NULL;
+	d->end = l+len;
+}
+
+#ifdef VI_DELIM_VECTOR
+/* Return a pointer to the first delimiter at or after 'from', or NULL
+ * if there are no more delimiters in the line. */
+static inline char *vi_delim_next(struct vi_delim *d, char *from) {
+	size_t off;
+	vi_mask_t bits;
+	int w;
+
+	while (from < d->end) {
+		if (d->base == NULL || from < d->base ||
+		        from >= d->base+VI_DELIM_WINDOW)
+			vi_delim_window(d, from);
+		off = from - d->base;
+		w = off >> 6;
+		bits = d->mask[w] & (~(vi_mask_t)0 << (off & 63));
+		while (1) {
+			if (bits)
+				return d->base + (w << 6) + vi_delim_ctz(bits);
+			if (++w == VI_DELIM_WORDS) break;
+			bits = d->mask[w];
+		}
+		from = d->base+VI_DELIM_WINDOW;
+	}
+	return NULL;
+}
+
+/* Return a pointer to the first delimiter 'c' at or after 'from', or
+ * NULL if there is not one in the line. */
+static inline char *vi_delim_find(struct vi_delim *d, char *from, int c) {
+	while ((from = vi_delim_next(d, from)) != NULL && *from != c)
+		from++;
+	return from;
+}
+#else
+static inline char *vi_delim_next(struct vi_delim *d, char *from) {
+	for (; from < d->end; from++) {
+		if (vi_is_delim(*from)) return from;
+	}
+	return NULL;
+}
+
+/* 'c' is a delimiter itself, so the other ones can be ignored */
+static inline char *vi_delim_find(struct vi_delim *d, char *from, int c) {
+	if (from >= d->end) return NULL;
+	return memchr(from, c, d->end-from);
+}
+#endif
+
+#endif /* __VI_DELIM_H */
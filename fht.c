@@ -0,0 +1,305 @@
+/* Flat open addressing hash tables of counters.
+ *
+ * Copyright (C) 2012 Camilo E. Hidalgo Estevez <camiloehe@gmail.com>
+ * All Rights Reserved.
+ *
+ * This software is released under the terms of the BSD license.
+ * Read the COPYING file in this distribution for more details.
+ *
+ * The entries live in a single array and collisions are resolved by
+ * linear probing, so a lookup reads one or two consecutive cache lines
+ * instead of following a pointer to every element and another one to
+ * its key. Every entry stores the hash of its key, compared before the
+ * key itself and reused when the table grows, a pointer to the key, and
+ * its counters inline:
+ * the hits, the bytes and the time of the first and of the last request,
+ * so every dimension of the statistics needs one lookup per line.
+ * Deletions shift back the entries that follow, so the table never
+ * fills up with tombstones.
+ *
+ * The keys are copied in an arena, usually shared by all the tables of
+ * a handle: a new key costs a few bytes at the end of a big chunk
+ * instead of a malloc(), and all the keys are released freeing just
+ * the chunks.
+ *
+ * Log lines come in bursts from the same clients, so the same user, host
+ * or site is often counted many times in a row. fht_insert_cached() looks
+ * the key up first in a small two-way cache of the last entries found,
+ * that stays in the CPU cache while the slots of a big table are spread
+ * over megabytes of memory. The set is chosen by the top bits of the
+ * hash, while the table uses the low ones, so keys colliding in the
+ * table don't collide in the cache too. A hit saves the probe of the
+ * table, not the hash of the key, that is computed anyway. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "aht.h"
+#include "fht.h"
+
+/* A table is grown when it is 70% full */
+#define fht_full(used, size) ((size_t)(used)*10 >= (size_t)(size)*7)
+
+/* Return the hash of the 'len' bytes key at 'key'. Zero marks the empty
+ * slots, so it is never returned. The hash is seeded with the secret set
+ * by ht_set_strong_hash_init_val(). */
+static unsigned int fht_hash(char *key, size_t len) {
+	unsigned int h = ht_fast_hash((u_int8_t*)key, len, 0);
+
+	return h ? h : 1;
+}
+
+/* Initialize an empty arena */
+void fht_arena_init(struct fht_arena *a) {
+	a->chunk = NULL;
+	a->bytes = 0;
+}
+
+/* Copy the 'len' bytes at 's' in the arena, adding a nul terminator.
+ * Return the copy, or NULL on out of memory. */
+char *fht_arena_strdup(struct fht_arena *a, char *s, size_t len) {
+	struct fht_chunk *c = a->chunk;
+	char *p;
+
+	if (c == NULL || c->used+len+1 > c->size) {
+		size_t size = FHT_CHUNK_SIZE;
+
+		if (len+1 > size/4) size = len+1;
+		if ((c = malloc(sizeof(*c)+size)) == NULL)
+			return NULL;
+		c->size = size;
+		c->used = 0;
+		/* A big key gets a chunk of its own, linked after the one
+		 * being filled so that its free space is not lost. */
+		if (size != FHT_CHUNK_SIZE && a->chunk) {
+			c->next = a->chunk->next;
+			a->chunk->next = c;
+		} else {
+			c->next = a->chunk;
+			a->chunk = c;
+		}
+		a->bytes += size;
+	}
+	p = c->data+c->used;
+	memcpy(p, s, len);
+	p[len] = '\0';
+	c->used += len+1;
+	return p;
+}
+
+/* Release all the chunks of the arena, that is left empty. The keys of
+ * the tables using it are no longer valid. */
+void fht_arena_free(struct fht_arena *a) {
+	struct fht_chunk *c, *next;
+
+	for (c = a->chunk; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	fht_arena_init(a);
+}
+
+/* Forget the cached entries, that are no longer valid when the entries
+ * are moved. */
+static void fht_cache_clear(struct fht *t) {
+	memset(t->cache, 0, sizeof(t->cache));
+}
+
+/* Initialize an empty table whose keys are copied in 'arena', no memory
+ * is allocated until the first insertion. */
+void fht_init(struct fht *t, struct fht_arena *arena) {
+	t->entry = NULL;
+	t->size = 0;
+	t->used = 0;
+	t->arena = arena;
+	fht_cache_clear(t);
+	t->lookups = 0;
+	t->cachehits = 0;
+}
+
+/* Release the memory of the table, that is left empty and reusable.
+ * The keys are released with the arena. The statistics of the cache
+ * are preserved. */
+void fht_destroy(struct fht *t) {
+	free(t->entry);
+	t->entry = NULL;
+	t->size = 0;
+	t->used = 0;
+	fht_cache_clear(t);
+}
+
+/* Move the entries to a new array of 'size' slots, a power of two.
+ * The hashes are stored in the entries, so no key is hashed again.
+ * Return 0 on success, non-zero on out of memory. */
+static int fht_resize(struct fht *t, size_t size) {
+	struct fht_entry *entry;
+	size_t i, j, mask = size-1;
+
+	if ((entry = calloc(size, sizeof(*entry))) == NULL)
+		return 1;
+	for (i = 0; i < t->size; i++) {
+		if (!t->entry[i].hash) continue;
+		j = t->entry[i].hash & mask;
+		while (entry[j].hash)
+			j = (j+1) & mask;
+		entry[j] = t->entry[i];
+	}
+	free(t->entry);
+	t->entry = entry;
+	t->size = size;
+	fht_cache_clear(t);
+	return 0;
+}
+
+/* Grow the table so that it can hold 'n' entries without to grow
+ * again. Return 0 on success, non-zero on out of memory. */
+int fht_expand(struct fht *t, size_t n) {
+	size_t size = t->size ? t->size : FHT_INITIAL_SIZE;
+
+	while (fht_full(n, size)) {
+		if (size >= 0x80000000U) return 1;
+		size *= 2;
+	}
+	if (size == t->size) return 0;
+	return fht_resize(t, size);
+}
+
+/* Return the slot of the key, or the empty slot where it would be
+ * added. The table must have been allocated. */
+static size_t fht_slot(struct fht *t, char *key, size_t len, unsigned int h) {
+	size_t mask = t->size-1, i = h & mask;
+	struct fht_entry *e;
+
+	while ((e = &t->entry[i])->hash) {
+		if (e->hash == h && e->len == len &&
+		    !memcmp(e->key, key, len))
+			break;
+		i = (i+1) & mask;
+	}
+	return i;
+}
+
+/* Return the entry of the 'len' bytes key at 'key', or NULL if the key
+ * is not in the table. */
+struct fht_entry *fht_find(struct fht *t, char *key, size_t len) {
+	struct fht_entry *e;
+
+	if (t->size == 0) return NULL;
+	e = &t->entry[fht_slot(t, key, len, fht_hash(key, len))];
+	return e->hash ? e : NULL;
+}
+
+/* fht_insert() of a key whose hash 'h' is already computed */
+static struct fht_entry *fht_insert_hash(struct fht *t, char *key, size_t len,
+                                         unsigned int h, int *added) {
+	struct fht_entry *e;
+
+	*added = 0;
+	if ((t->size == 0 || fht_full(t->used+1, t->size)) &&
+	    fht_expand(t, t->used+1))
+		return NULL;
+	e = &t->entry[fht_slot(t, key, len, h)];
+	if (e->hash) return e;
+	if ((e->key = fht_arena_strdup(t->arena, key, len)) == NULL)
+		return NULL;
+	e->hash = h;
+	e->len = len;
+	e->hits = 0;
+	e->bytes = 0;
+	e->first = 0;
+	e->last = 0;
+	t->used++;
+	*added = 1;
+	return e;
+}
+
+/* Return the entry of the 'len' bytes key at 'key', adding it with zero
+ * counters if it is not in the table: '*added' is set to non-zero
+ * in this case. The key is copied in the arena of the table. Return NULL
+ * on out of memory.
+ *
+ * The entry is valid until the next insertion, that may move it. */
+struct fht_entry *fht_insert(struct fht *t, char *key, size_t len, int *added) {
+	return fht_insert_hash(t, key, len, fht_hash(key, len), added);
+}
+
+/* Like fht_insert(), but the key is searched first in the cache of the
+ * recently used entries, and the entry is cached. A cached key is found
+ * without to probe the table: the hash, the length and the bytes of the
+ * key are compared with the ones of the slots of a single set of the
+ * cache. The slots of a set are kept most recently used first, and a
+ * new entry replaces the last one. */
+struct fht_entry *fht_insert_cached(struct fht *t, char *key, size_t len,
+                                    int *added) {
+	unsigned int h = fht_hash(key, len);
+	struct fht_cache *set, hit;
+	struct fht_entry *e;
+	int i;
+
+	set = &t->cache[(h >> (32-FHT_CACHE_BITS)) * FHT_CACHE_WAYS];
+	t->lookups++;
+	for (i = 0; i < FHT_CACHE_WAYS; i++) {
+		struct fht_cache *c = &set[i];
+
+		if (c->hash == h && c->len == len &&
+		    !memcmp(c->key, key, len)) {
+			t->cachehits++;
+			*added = 0;
+			hit = *c;
+			memmove(set+1, set, sizeof(*set)*i);
+			set[0] = hit;
+			return hit.entry;
+		}
+	}
+	if ((e = fht_insert_hash(t, key, len, h, added)) == NULL)
+		return NULL;
+	memmove(set+1, set, sizeof(*set)*(FHT_CACHE_WAYS-1));
+	set[0].hash = h;
+	set[0].len = len;
+	set[0].key = e->key;
+	set[0].entry = e;
+	return e;
+}
+
+/* Remove the key from the table. The entries after it in the same run
+ * are shifted back to fill the hole, unless they are already in their
+ * home slot or before it. The bytes of the key are not reclaimed until
+ * the arena is released. Return 0 on success, non-zero if the key is
+ * not in the table. */
+int fht_del(struct fht *t, char *key, size_t len) {
+	size_t mask, i, j, home;
+
+	if (t->size == 0) return 1;
+	mask = t->size-1;
+	i = fht_slot(t, key, len, fht_hash(key, len));
+	if (!t->entry[i].hash) return 1;
+	for (j = (i+1) & mask; t->entry[j].hash; j = (j+1) & mask) {
+		home = t->entry[j].hash & mask;
+		/* The entry can move to 'i' if its home is not in (i, j] */
+		if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+			t->entry[i] = t->entry[j];
+			i = j;
+		}
+	}
+	t->entry[i].hash = 0;
+	t->used--;
+	fht_cache_clear(t);
+	return 0;
+}
+
+/* Return an array of pointers to the 'used' entries of the table, in no
+ * particular order. The pointers are valid until the next insertion or
+ * deletion. Return NULL on out of memory. The array must be freed by the
+ * caller. */
+struct fht_entry **fht_get_entries(struct fht *t) {
+	struct fht_entry **table;
+	size_t i, j = 0;
+
+	if ((table = malloc(sizeof(*table)*(t->used ? t->used : 1))) == NULL)
+		return NULL;
+	for (i = 0; i < t->size; i++) {
+		if (t->entry[i].hash)
+			table[j++] = &t->entry[i];
+	}
+	return table;
+}
@@ -0,0 +1,88 @@
+/* Flat open addressing hash tables of counters.
+ *
+ * Copyright (C) 2012 Camilo E. Hidalgo Estevez <camiloehe@gmail.com>
+ * All Rights Reserved.
+ *
+ * This software is released under the terms of the BSD license.
+ * Read the COPYING file in this distribution for more details. */
+
+#ifndef __VI_FHT_H
+#define __VI_FHT_H
+
+#include <stddef.h>
+
+/* Number of slots allocated by the first insertion */
+#define FHT_INITIAL_SIZE 64
+
+/* Size of the chunks the keys are allocated from, longer keys get a
+ * chunk of their own */
+#define FHT_CHUNK_SIZE (256*1024)
+
+/* The cache of the most recently used keys has 2^FHT_CACHE_BITS sets of
+ * FHT_CACHE_WAYS slots */
+#define FHT_CACHE_BITS 5
+#define FHT_CACHE_WAYS 2
+#define FHT_CACHE_SIZE ((1<<FHT_CACHE_BITS)*FHT_CACHE_WAYS)
+
+/* An entry of the table. The slot is empty if 'hash' is zero. */
+struct fht_entry {
+	unsigned int hash;	/* hash of the key, never zero */
+	unsigned int len;	/* length of the key */
+	char *key;		/* nul-terminated, in the arena of the table */
+	long long hits;
+	long long bytes;
+	long long first;	/* time of the first and of the last request, */
+	long long last;		/* seconds since the epoch, zero if unknown */
+};
+
+/* A slot of the cache of the recently used keys. Empty if 'hash' is zero. */
+struct fht_cache {
+	unsigned int hash;
+	unsigned int len;
+	char *key;
+	struct fht_entry *entry;
+};
+
+struct fht_chunk {
+	struct fht_chunk *next;	/* chunk allocated before this one */
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+/* Bump pointer allocator of the keys. Many tables can share the same
+ * arena, that is released at once when all of them are destroyed. */
+struct fht_arena {
+	struct fht_chunk *chunk;	/* the chunk being filled */
+	size_t bytes;			/* total size of the chunks */
+};
+
+struct fht {
+	struct fht_entry *entry;
+	unsigned int size;	/* slots, a power of two, or zero */
+	unsigned int used;
+	struct fht_arena *arena;	/* where the keys are copied */
+	struct fht_cache cache[FHT_CACHE_SIZE];
+	long long lookups;	/* calls of fht_insert_cached() */
+	long long cachehits;	/* ... answered by the cache */
+};
+
+void fht_arena_init(struct fht_arena *a);
+char *fht_arena_strdup(struct fht_arena *a, char *s, size_t len);
+void fht_arena_free(struct fht_arena *a);
+void fht_init(struct fht *t, struct fht_arena *arena);
+void fht_destroy(struct fht *t);
+int fht_expand(struct fht *t, size_t n);
+struct fht_entry *fht_find(struct fht *t, char *key, size_t len);
+struct fht_entry *fht_insert(struct fht *t, char *key, size_t len, int *added);
+struct fht_entry *fht_insert_cached(struct fht *t, char *key, size_t len,
+                                    int *added);
+int fht_del(struct fht *t, char *key, size_t len);
+struct fht_entry **fht_get_entries(struct fht *t);
+
+#define fht_size(t) ((t)->size)
+#define fht_used(t) ((t)->used)
+#define fht_busy(t, i) ((t)->entry[(i)].hash != 0)
+#define fht_entry(t, i) (&(t)->entry[(i)])
+
+#endif /* __VI_FHT_H */
@@ -0,0 +1,138 @@
+/* Microbenchmark of the hash functions of the tables.
+ *
+ * Copyright (C) 2012 Camilo E. Hidalgo Estevez <camiloehe@gmail.com>
+ * All Rights Reserved.
+ *
+ * This software is released under the terms of the BSD license.
+ * Read the COPYING file in this distribution for more details.
+ *
+ * Compares __ht_strong_hash(), the byte at a time Bob Jenkins' hash, with
+ * __ht_fast_hash(), the word at a time one, hashing the same keys many
+ * times. The keys are the space separated fields of the log files given
+ * in the command line, or synthetic keys of some typical lengths if no
+ * file is given. Build it with "make hashbench". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "aht.h"
+
+#define HB_MAXKEYS 1000000
+#define HB_BYTES (64*1024*1024)	/* bytes hashed by every run */
+
+struct hb_keys {
+	char **key;
+	size_t *len;
+	size_t count;
+	size_t bytes;
+};
+
+static long long hb_ustime(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (long long)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+static void hb_add(struct hb_keys *k, char *key, size_t len) {
+	if (k->count == HB_MAXKEYS || len == 0) return;
+	if ((k->key[k->count] = malloc(len)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memcpy(k->key[k->count], key, len);
+	k->len[k->count++] = len;
+	k->bytes += len;
+}
+
+/* Add the fields of the lines of 'filename' to the keys */
+static void hb_load(struct hb_keys *k, char *filename) {
+	char buf[8192], *p, *f;
+	FILE *fp;
+
+	if ((fp = fopen(filename, "r")) == NULL) {
+		perror(filename);
+		exit(1);
+	}
+	while (k->count < HB_MAXKEYS && fgets(buf, sizeof(buf), fp)) {
+		buf[strcspn(buf, "\r\n")] = '\0';
+		for (p = buf; *p; p = *f ? f+1 : f) {
+			f = p + strcspn(p, " ");
+			hb_add(k, p, f-p);
+		}
+	}
+	fclose(fp);
+}
+
+/* Replace the keys with 'count' random keys of 'len' bytes */
+static void hb_synthetic(struct hb_keys *k, size_t len, size_t count) {
+	char buf[1024];
+	size_t i, j;
+
+	while (k->count) free(k->key[--k->count]);
+	k->bytes = 0;
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < len; j++)
+			buf[j] = "abcdefghijklmnopqrstuvwxyz0123456789/."[rand() % 38];
+		hb_add(k, buf, len);
+	}
+}
+
+/* Hash the keys again and again until about HB_BYTES bytes are hashed,
+ * printing the nanoseconds per key and the throughput of both hashes. */
+static void hb_run(struct hb_keys *k, char *name) {
+	size_t rounds = HB_BYTES / (k->bytes ? k->bytes : 1) + 1, r, i;
+	long long t0, t1, t2;
+	u_int32_t s32 = 0;
+	u_int64_t s64 = 0;
+	double n = (double)rounds*k->count;
+
+	t0 = hb_ustime();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < k->count; i++)
+			s32 += __ht_strong_hash((u_int8_t*)k->key[i], k->len[i], r);
+	t1 = hb_ustime();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < k->count; i++)
+			s64 += __ht_fast_hash((u_int8_t*)k->key[i], k->len[i], r);
+	t2 = hb_ustime();
+	printf("%-12s %8lu keys %6.1f avg bytes | strong %6.2f ns/key %7.1f MB/s"
+	       " | fast %6.2f ns/key %7.1f MB/s | %4.2fx  (%08x %08x)\n",
+	       name, (unsigned long)k->count, (double)k->bytes/k->count,
+	       (t1-t0)*1000.0/n, (double)k->bytes*rounds/(t1-t0),
+	       (t2-t1)*1000.0/n, (double)k->bytes*rounds/(t2-t1),
+	       (double)(t1-t0)/(t2-t1), s32, (u_int32_t)s64);
+}
+
+int main(int argc, char **argv) {
+	static size_t lens[] = {4, 8, 12, 16, 24, 32, 48, 64, 128, 256};
+	struct hb_keys k;
+	char name[32];
+	int i;
+
+	k.key = malloc(sizeof(char*)*HB_MAXKEYS);
+	k.len = malloc(sizeof(size_t)*HB_MAXKEYS);
+	k.count = k.bytes = 0;
+	if (k.key == NULL || k.len == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	if (argc > 1) {
+		for (i = 1; i < argc; i++)
+			hb_load(&k, argv[i]);
+		if (k.count == 0) {
+			fprintf(stderr, "No keys found\n");
+			return 1;
+		}
+		hb_run(&k, "log fields");
+		return 0;
+	}
+	for (i = 0; i < (int)(sizeof(lens)/sizeof(lens[0])); i++) {
+		hb_synthetic(&k, lens[i], 10000);
+		snprintf(name, sizeof(name), "%lu bytes", (unsigned long)lens[i]);
+		hb_run(&k, name);
+	}
+	return 0;
+}
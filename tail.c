@@ -1,8 +1,26 @@
+/* Tail mode and follow mode of log files.
+ *
+ * The tail mode just copies the data appended to the files to the
+ * standard output, like tail -f, to feed a visited running in stream
+ * mode. The follow mode instead returns the new lines to the caller, that
+ * processes them in the same process: on Linux the files are watched
+ * with inotify, so many files can be followed without polling them. */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#define VI_HAVE_INOTIFY
+#endif
 
 #include "sleep.h"
+#include "tail.h"
 
 /* Open a file, seek at the end, and store in '*len' the file length */
 static FILE *vi_openAtEnd(char *filename, long *len)
@@ -71,7 +89,7 @@ void vi_tail(int filec, char **filev)
 		fprintf(stderr, "No files specified in tail-mode\n");
 		exit(1);
 	}
-	len = malloc(filec);
+	len = malloc(sizeof(long)*filec);
 	if (!len) {
 		fprintf(stderr, "Out of memory\n");
 		exit(1);
@@ -85,3 +103,272 @@ void vi_tail(int filec, char **filev)
 		vi_sleep(1);
 	}
 }
+
+/* ------------------------------- follow mode ------------------------------ */
+#ifdef VI_HAVE_INOTIFY
+#define VI_FOLLOW_FILE_EVENTS (IN_MODIFY|IN_MOVE_SELF|IN_DELETE_SELF|IN_ATTRIB)
+#define VI_FOLLOW_DIR_EVENTS (IN_CREATE|IN_MOVED_TO)
+#endif
+
+/* Open the followed file 'ff' at 'offset', where the data already
+ * processed ends: zero if the file was created by a rotation, -1 to
+ * start from the current end of the file. If the file is now shorter
+ * than 'offset' it was truncated, and it is read from the start.
+ * Returns 0 on success, -1 on error. */
+static int vi_follow_open(struct vi_follow *f, struct vi_followfile *ff,
+                          long long offset)
+{
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(ff->filename, O_RDONLY)) == -1) return -1;
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return -1;
+	}
+	ff->fd = fd;
+	ff->ino = sb.st_ino;
+	ff->dev = sb.st_dev;
+	if (offset < 0)
+		offset = sb.st_size;
+	else if (offset > (long long)sb.st_size)
+		offset = 0;
+	ff->offset = offset;
+	if (lseek(fd, ff->offset, SEEK_SET) == -1) ff->offset = 0;
+	/* Read at once what was appended after the offset */
+	ff->modified = ff->offset < (long long)sb.st_size || offset == 0;
+#ifdef VI_HAVE_INOTIFY
+	if (f->fd != -1)
+		ff->wd = inotify_add_watch(f->fd, ff->filename,
+		                           VI_FOLLOW_FILE_EVENTS);
+#else
+	(void) f;
+#endif
+	return 0;
+}
+
+/* Pass the partial last line of 'ff' to the callback as a complete
+ * line: the file ended without a newline. */
+static int vi_follow_flush(struct vi_followfile *ff, vi_follow_cb *cb,
+                           void *privdata)
+{
+	int retval = 0;
+
+	if (ff->partlen) retval = cb(privdata, ff->partial, ff->partlen);
+	ff->partlen = 0;
+	ff->skip = 0;
+	return retval;
+}
+
+/* Read all the new data of the followed file 'ff', passing the complete
+ * lines to the callback. Returns non-zero if the callback failed. */
+static int vi_follow_drain(struct vi_follow *f, struct vi_followfile *ff,
+                           vi_follow_cb *cb, void *privdata)
+{
+	struct stat sb;
+	size_t used, len;
+	ssize_t n;
+	char *nl;
+	int retval = 0;
+
+	if (ff->fd == -1) return 0;
+	/* Truncated file, like with logrotate copytruncate */
+	if (fstat(ff->fd, &sb) == 0 && sb.st_size < ff->offset) {
+		retval |= vi_follow_flush(ff, cb, privdata);
+		lseek(ff->fd, 0, SEEK_SET);
+		ff->offset = 0;
+	}
+	used = ff->partlen;
+	memcpy(f->buf, ff->partial, used);
+	while ((n = read(ff->fd, f->buf+used, VI_FOLLOW_BUFLEN-used)) > 0) {
+		ff->offset += n;
+		used += n;
+		if (ff->skip) {
+			/* Drop the rest of a line longer than the buffer */
+			if ((nl = memchr(f->buf, '\n', used)) == NULL) {
+				used = 0;
+				continue;
+			}
+			ff->skip = 0;
+			len = nl-f->buf+1;
+			memmove(f->buf, f->buf+len, used-len);
+			used -= len;
+		}
+		for (len = used; len > 0 && f->buf[len-1] != '\n'; len--);
+		if (len == 0 && used == VI_FOLLOW_BUFLEN) {
+			retval |= cb(privdata, f->buf, used);
+			used = 0;
+			ff->skip = 1;
+			continue;
+		}
+		if (len == 0) continue;
+		retval |= cb(privdata, f->buf, len);
+		memmove(f->buf, f->buf+len, used-len);
+		used -= len;
+	}
+	/* Keep the partial line for the next time */
+	if (used > ff->partlen) {
+		char *p = realloc(ff->partial, used);
+
+		if (p == NULL) {
+			used = ff->partlen; /* the line is truncated */
+		} else {
+			ff->partial = p;
+		}
+	}
+	memcpy(ff->partial, f->buf, used);
+	ff->partlen = used;
+	ff->modified = 0;
+	return retval;
+}
+
+/* Check if the followed file 'ff' was rotated, that is, if its name now
+ * refers to a different file. The rest of the old file is read before to
+ * switch to the new one, so no line is lost.
+ * Returns non-zero if the callback failed. */
+static int vi_follow_check(struct vi_follow *f, struct vi_followfile *ff,
+                           vi_follow_cb *cb, void *privdata)
+{
+	struct stat sb;
+	int retval = 0;
+
+	ff->moved = 0;
+	if (stat(ff->filename, &sb) == -1) return 0; /* not yet created */
+	if (ff->fd != -1 && (long long)sb.st_ino == ff->ino &&
+	    (long long)sb.st_dev == ff->dev) return 0;
+	if (ff->fd != -1) {
+		retval |= vi_follow_drain(f, ff, cb, privdata);
+		retval |= vi_follow_flush(ff, cb, privdata);
+		close(ff->fd);
+		ff->fd = -1;
+#ifdef VI_HAVE_INOTIFY
+		if (f->fd != -1 && ff->wd != -1)
+			inotify_rm_watch(f->fd, ff->wd);
+		ff->wd = -1;
+#endif
+	}
+	if (vi_follow_open(f, ff, 0) == 0)
+		retval |= vi_follow_drain(f, ff, cb, privdata);
+	return retval;
+}
+
+/* Start to follow the 'filec' files in 'filev' from the offsets in
+ * 'offsets', where the data already processed ends (-1 for the current
+ * end of the file), or from their current end if 'offsets' is NULL.
+ * Files that don't exist yet are followed from the start once created.
+ * Returns NULL on out of memory. */
+struct vi_follow *vi_follow_new(int filec, char **filev, long long *offsets)
+{
+	struct vi_follow *f;
+	int i;
+
+	if ((f = calloc(1, sizeof(*f))) == NULL) return NULL;
+	f->fd = -1;
+	if ((f->file = calloc(filec, sizeof(*f->file))) == NULL ||
+	    (f->buf = malloc(VI_FOLLOW_BUFLEN)) == NULL) goto oom;
+#ifdef VI_HAVE_INOTIFY
+	f->fd = inotify_init1(IN_NONBLOCK);
+#endif
+	for (i = 0; i < filec; i++) {
+		struct vi_followfile *ff = &f->file[i];
+		char *slash;
+
+		ff->fd = ff->wd = ff->dirwd = -1;
+		if ((ff->filename = strdup(filev[i])) == NULL) goto oom;
+		f->filec++;
+		slash = strrchr(ff->filename, '/');
+		ff->basename = slash ? slash+1 : ff->filename;
+#ifdef VI_HAVE_INOTIFY
+		/* Watch the directory too, to know when the file is
+		 * created again after a rotation. */
+		if (f->fd != -1) {
+			if (slash) *slash = '\0';
+			ff->dirwd = inotify_add_watch(f->fd,
+			        slash ? (slash == ff->filename ? "/" :
+			        ff->filename) : ".", VI_FOLLOW_DIR_EVENTS);
+			if (slash) *slash = '/';
+		}
+#endif
+		vi_follow_open(f, ff, offsets ? offsets[i] : -1);
+	}
+	return f;
+
+oom:
+	vi_follow_free(f);
+	return NULL;
+}
+
+/* Return the descriptor to wait for before to call vi_follow_read(), or
+ * -1 if inotify is not available: then vi_follow_read() must be called
+ * periodically, as every file is checked for changes. */
+int vi_follow_fd(struct vi_follow *f)
+{
+	return f->fd;
+}
+
+/* Pass the new lines of the followed files to the callback 'cb', in
+ * blocks of complete lines, handling the rotation of the files.
+ * Returns non-zero if the callback failed for some block. */
+int vi_follow_read(struct vi_follow *f, vi_follow_cb *cb, void *privdata)
+{
+	int i, retval = 0;
+
+	if (f->fd == -1) {
+		/* No notifications: check everything */
+		for (i = 0; i < f->filec; i++)
+			f->file[i].modified = f->file[i].moved = 1;
+	}
+#ifdef VI_HAVE_INOTIFY
+	while (f->fd != -1) {
+		char ev[sizeof(struct inotify_event)*64+4096]
+		        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+		ssize_t n = read(f->fd, ev, sizeof(ev)), off;
+
+		if (n <= 0) break;
+		for (off = 0; off < n; ) {
+			struct inotify_event *e = (struct inotify_event*)(ev+off);
+
+			for (i = 0; i < f->filec; i++) {
+				struct vi_followfile *ff = &f->file[i];
+
+				if (e->mask & IN_Q_OVERFLOW) {
+					ff->modified = ff->moved = 1;
+				} else if (e->wd == ff->wd) {
+					if (e->mask & IN_MODIFY)
+						ff->modified = 1;
+					else
+						ff->moved = 1;
+				} else if (e->wd == ff->dirwd && e->len &&
+				           !strcmp(e->name, ff->basename)) {
+					ff->moved = 1;
+				}
+			}
+			off += sizeof(struct inotify_event) + e->len;
+		}
+	}
+#endif
+	for (i = 0; i < f->filec; i++) {
+		struct vi_followfile *ff = &f->file[i];
+
+		if (ff->modified)
+			retval |= vi_follow_drain(f, ff, cb, privdata);
+		if (ff->moved)
+			retval |= vi_follow_check(f, ff, cb, privdata);
+	}
+	return retval;
+}
+
+void vi_follow_free(struct vi_follow *f)
+{
+	int i;
+
+	for (i = 0; i < f->filec; i++) {
+		if (f->file[i].fd != -1) close(f->file[i].fd);
+		free(f->file[i].filename);
+		free(f->file[i].partial);
+	}
+	if (f->fd != -1) close(f->fd);
+	free(f->file);
+	free(f->buf);
+	free(f);
+}
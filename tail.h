@@ -0,0 +1,52 @@
+/* Tail mode and follow mode of log files.
+ *
+ * Copyright (C) 2012 Camilo E. Hidalgo Estevez <camiloehe@gmail.com>
+ * All Rights Reserved.
+ *
+ * This software is released under the terms of the BSD license.
+ * Read the COPYING file in this distribution for more details. */
+
+#ifndef __VI_TAIL_H
+#define __VI_TAIL_H
+
+#include <stddef.h>
+
+/* Size of the buffer new data is read into */
+#define VI_FOLLOW_BUFLEN (1024*1024)
+
+/* Called with a block of 'len' bytes of complete lines. The newlines are
+ * still in place. A line longer than VI_FOLLOW_BUFLEN is passed once,
+ * without newline, as the first VI_FOLLOW_BUFLEN bytes of it: the rest
+ * is dropped. Returns non-zero on error. */
+typedef int vi_follow_cb(void *privdata, char *buf, size_t len);
+
+struct vi_followfile {
+	char *filename;
+	int fd;			/* -1 if the file does not exist */
+	long long ino;		/* identity of the open file */
+	long long dev;
+	long long offset;	/* bytes already returned */
+	int wd;			/* inotify watch of the file */
+	int dirwd;		/* inotify watch of its directory */
+	char *basename;		/* name inside the directory */
+	char *partial;		/* last line without newline */
+	size_t partlen;
+	int skip;		/* dropping the rest of a too long line */
+	int modified;		/* new data may be available */
+	int moved;		/* the file may have been rotated */
+};
+
+struct vi_follow {
+	int fd;			/* inotify descriptor, -1 if polling */
+	int filec;
+	struct vi_followfile *file;
+	char *buf;
+};
+
+void vi_tail(int filec, char **filev);
+struct vi_follow *vi_follow_new(int filec, char **filev, long long *offsets);
+int vi_follow_fd(struct vi_follow *f);
+int vi_follow_read(struct vi_follow *f, vi_follow_cb *cb, void *privdata);
+void vi_follow_free(struct vi_follow *f);
+
+#endif /* __VI_TAIL_H */
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Regression tests of the log parsers, run by "make check".
+#
+# Every log of this directory is processed with the options of its line
+# below, and the text report is compared with the expected one in the
+# .txt file of the same name. The lines that change at every run (the
+# version and the time of the report) are left out. With "update" as
+# second argument the expected reports are written again instead.
+#
+# usage: tests/run.sh <visited binary> [update]
+
+bin=$1
+mode=$2
+dir=`dirname $0`
+failed=0
+
+# Times are printed in the local timezone
+TZ=UTC
+export TZ
+
+while read name opts; do
+	out=$dir/$name.out
+	eval "$bin -A -o text $opts $dir/$name.log" 2>/dev/null | \
+	    grep -v "^Statistics generated with\|^--- Generated:\|^\* Processing time" \
+	    > $out
+	if [ "$mode" = "update" ]; then
+		mv $out $dir/$name.txt
+		echo "updated $name"
+	elif cmp -s $out $dir/$name.txt; then
+		rm -f $out
+		echo "ok     $name"
+	else
+		diff $dir/$name.txt $out | head -20
+		echo "FAILED $name (see $out)"
+		failed=1
+	fi
+done <<EOF
+format --log-format '%h %u %{sec}t "%r" %>s %B'
+w3c --log-format w3c
+squid --log-format squid
+json --log-format json
+EOF
+exit $failed
@@ -16,15 +16,32 @@
 #include <errno.h>
 #include <locale.h>
 #include <ctype.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#define VI_HAVE_MMAP
+#define VI_HAVE_THREADS
+#define VI_HAVE_POLL
+#endif
 
 #include "aht.h"
 #include "antigetopt.h"
 #include "sleep.h"
 #include "blacklist.h"
+#include "decomp.h"
+#include "tail.h"
+#include "delim.h"
+#include "fht.h"
 
 /* Max length of an error stored in the visitors handle */
 #define VI_ERROR_MAX 1024
-/* Max length of a log line */
+/* Max length of a log line plus one, longer lines are invalid entries */
 #define VI_LINE_MAX 4096
 /* Max number of filenames in the command line */
 #define VI_FILENAMES_MAX 1024
@@ -36,11 +53,105 @@
 #define VI_HTML_ABBR_LEN 100
 /* Max length of a log entry date */
 #define VI_DATE_MAX 64
+/* Number of hashtables in the visited handle, see vi_get_tables() */
+#define VI_TABLES 9
+/* Number of series of counters in the visited handle, see vi_get_series() */
+#define VI_SERIES 3
+/* Max absolute index of a series, days since the epoch fit well in it */
+#define VI_SERIES_MAX 10000000
+/* Max size of a request in bytes, bigger sizes are bogus and clamped so
+ * that the 64 bit totals of billions of requests can't overflow */
+#define VI_SIZE_MAX ((1LL<<48)-1)
+/* Max number of threads used to scan the log files */
+#define VI_THREADS_MAX 256
+/* Files are split in jobs of at most this size for the parallel scan,
+ * smaller if needed to give VI_CHUNKS_PER_THREAD jobs to every worker,
+ * but not smaller than VI_CHUNK_MIN */
+#define VI_CHUNK_BYTES (16*1024*1024)
+#define VI_CHUNK_MIN (256*1024)
+#define VI_CHUNKS_PER_THREAD 4
+/* Size of the buffer compressed files are decompressed into */
+#define VI_DECOMP_BUFLEN (4*1024*1024)
+/* Expected compression ratio of logs, used to schedule compressed files */
+#define VI_DECOMP_RATIO 8
+/* Size of the buffer the standard input is read into in stream mode */
+#define VI_STREAM_BUFLEN (1024*1024)
+/* Uncompressed bytes between the access points of a seek index */
+#define VI_INDEX_SPAN (4*1024*1024)
+/* Suffix of the sidecar files storing the seek index of compressed logs */
+#define VI_INDEX_SUFFIX ".vidx"
+/* Days of log remembered by the date cache, must be a power of two */
+#define VI_DATECACHE_SIZE 16
+/* Max number of fields and literals of a --log-format */
+#define VI_LOGFORMAT_STEPS 64
+/* Max number of columns of a W3C extended log, the others are ignored */
+#define VI_W3C_COLUMNS 64
 /* Version as a string */
 #define VI_VERSION_STR "0.25"
 
 /*------------------------------- data structures ----------------------------*/
 
+/* per worker statistics of a parallel scan, see --threads */
+struct vi_workerstat {
+	int jobs;
+	int stolen;
+	int lines;
+	long long bytes;
+	double busy;	/* seconds spent processing jobs */
+};
+
+/* Counters indexed by a dense range of integers, like the days or the
+ * months since the epoch. The range grows as needed. */
+struct vi_series {
+	int first;		/* index of counter[0] */
+	int len;		/* number of counters */
+	long long *counter;
+};
+
+/* A day of log in the date cache: the epoch of its first second and
+ * the local dates it spans once shifted by --time-delta, so that the
+ * time of the lines of that day is computed without mktime(). */
+struct vi_dateday {
+	char key[11];		/* "dd/Mon/yyyy" */
+	int valid;		/* 0 unused, 1 cached, -1 day with a DST change */
+	int day;		/* days since the epoch of the log date */
+	int month;		/* months since the epoch of the log date */
+	time_t start;		/* epoch of dd/Mon/yyyy:00:00:00 */
+	int startsec;		/* local second of the day at 'start' */
+	int split;		/* seconds from 'start' to the next local day */
+	struct tm first;	/* local date before 'split' */
+	struct tm next;		/* local date after 'split' */
+};
+
+/* A local day in the cache of the epoch times, see vi_epoch_localtime() */
+struct vi_epochday {
+	int valid;
+	time_t start;		/* epoch of the local midnight */
+	struct tm tm;		/* local date at 'start' */
+};
+
+/* Fields of the W3C extended log format, see vi_parse_w3c() */
+#define VI_W3C_SKIP	0	/* any other field */
+#define VI_W3C_DATE	1	/* date, yyyy-mm-dd */
+#define VI_W3C_TIME	2	/* time, hh:mm:ss */
+#define VI_W3C_HOST	3	/* c-ip */
+#define VI_W3C_USER	4	/* cs-username */
+#define VI_W3C_METHOD	5	/* cs-method */
+#define VI_W3C_URL	6	/* cs-uri-stem, cs-uri */
+#define VI_W3C_QUERY	7	/* cs-uri-query */
+#define VI_W3C_STATUS	8	/* sc-status */
+#define VI_W3C_SIZE	9	/* sc-bytes */
+#define VI_W3C_FIELDS	10
+
+/* Layout of the lines of a W3C extended log, declared by the last
+ * "#Fields:" directive, and the date of the last "#Date:" directive,
+ * used if the lines have no date field. */
+struct vi_w3c {
+	int columns;		/* 0 until the first #Fields: */
+	unsigned char field[VI_W3C_COLUMNS];	/* VI_W3C_* of every column */
+	int day;		/* days since the epoch of #Date:, or -1 */
+};
+
 /* visited handle */
 struct vih {
 	int startt;
@@ -50,38 +161,49 @@ struct vih {
 	int blacklisted;
 
 	int hour_hits[24];
-	int hour_size[24];
+	long long hour_size[24];
 	int weekday_hits[7];
-	int weekday_size[7];
+	long long weekday_size[7];
 	int weekdayhour_hits[7][24]; /* hour and weekday combined data */
-	int weekdayhour_size[7][24]; /* hour and weekday combined data */
+	long long weekdayhour_size[7][24]; /* hour and weekday combined data */
 	int monthday_hits[12][31]; /* month and day combined data */
-	int monthday_size[12][31]; /* month and day combined data */
+	long long monthday_size[12][31]; /* month and day combined data */
+
+	/* hits, traffic and time of the first and last request by key,
+	 * the keys of all the tables are allocated from 'keys' */
+	struct fht_arena keys;
+	struct fht pages;
+	struct fht sites;
 
-	struct hashtable pages_hits;
-	struct hashtable pages_size;
-	struct hashtable sites_hits;
-	struct hashtable sites_size;
+	struct fht users;
+	struct fht hosts;
+	struct fht codes;
+	struct fht verbs;
 
-	struct hashtable users_hits;
-	struct hashtable users_size;
-	struct hashtable hosts_hits;
-	struct hashtable hosts_size;
-	struct hashtable codes_hits;
-	struct hashtable codes_size;
-	struct hashtable verbs_hits;
-	struct hashtable verbs_size;
+	struct fht types;
 
-	struct hashtable types_hits;
-	struct hashtable types_size;
+	struct vi_series month_hits;	/* by month since the epoch */
+	struct vi_series month_size;
 
-	struct hashtable month_hits;
-	struct hashtable month_size;
+	struct fht error404;
 
-	struct hashtable error404;
+	struct fht results;	/* by squid cache result code */
 
-	struct hashtable date;
+	struct vi_series date;		/* by day since the epoch */
 	char *error;
+
+	int workers;	/* number of workers of the last parallel scan */
+	struct vi_workerstat *workerstat;
+
+	long long compressed_bytes;	/* read from compressed files */
+	long long uncompressed_bytes;	/* produced decompressing them */
+	double decomp_time;		/* seconds spent on compressed files */
+
+	struct vi_dateday datecache[VI_DATECACHE_SIZE];
+	struct vi_epochday epochday[2];	/* local and --time-delta shifted */
+
+	struct vi_w3c w3c;		/* layout of the W3C log being read */
+	char w3curl[VI_LINE_MAX];	/* url and query not joined in place */
 };
 
 /* info associated with a line of log */
@@ -94,9 +216,46 @@ struct logline {
 	char *req;
 	char *code;
 	char *verb;
-	long size;
+	char *result;	/* squid cache result code, like TCP_HIT, or NULL */
+	long long size;	/* bytes */
 	time_t time;
 	struct tm tm;
+	int day;	/* days since the epoch of the date, see vi_date_index() */
+	int month;	/* months since the epoch */
+};
+
+/* Fields of a --log-format, see vi_logformat_compile() */
+#define VI_FMT_LITERAL	0	/* text to match, a space matches many */
+#define VI_FMT_HOST	1	/* %h %a */
+#define VI_FMT_USER	2	/* %u */
+#define VI_FMT_TIME	3	/* %t, [dd/Mon/yyyy:hh:mm:ss zone] */
+#define VI_FMT_EPOCH	4	/* %{sec}t, seconds since the epoch */
+#define VI_FMT_EPOCHMS	5	/* %{msec}t, milliseconds since the epoch */
+#define VI_FMT_REQUEST	6	/* %r, "verb url version" */
+#define VI_FMT_METHOD	7	/* %m */
+#define VI_FMT_URL	8	/* %U */
+#define VI_FMT_STATUS	9	/* %s %>s */
+#define VI_FMT_SIZE	10	/* %b %B %O */
+#define VI_FMT_SKIP	11	/* any other directive */
+
+/* A step of a compiled log format: a literal to match, or a field ending
+ * at the first 'term' character (at a space or at the end of the line
+ * for the last field of the format). */
+struct vi_fmtstep {
+	int type;
+	char *lit;		/* VI_FMT_LITERAL only */
+	int len;
+	int term;
+};
+
+/* A log format compiled by vi_logformat_compile() */
+struct vi_logformat {
+	char *name;
+	/* vi_parse_format(), or the parser of a format that can't be
+	 * described with the directives, like the W3C extended one */
+	int (*parser)(struct vih *vih, struct logline *ll, char *l, int len);
+	int steps;
+	struct vi_fmtstep step[VI_LOGFORMAT_STEPS];
 };
 
 /* output module structure. See below for the definition of
@@ -106,14 +265,14 @@ struct outputmodule {
 	void (*print_footer)(FILE *fp);
 	void (*print_title)(FILE *fp, char *title);
 	void (*print_subtitle)(FILE *fp, char *title);
-	void (*print_numkey_info)(FILE *fp, char *key, int val);
+	void (*print_numkey_info)(FILE *fp, char *key, long long val);
 	void (*print_keykey_entry)(FILE *fp, char *key1, char *key2, int num);
-	void (*print_numkey_entry)(FILE *fp, char *key, int val, char *link,
-	                           int num);
-	void (*print_numkeybar_entry)(FILE *fp, char *key, int max, int tot,
-	                              int this);
-	void (*print_numkeycomparativebar_entry)(FILE *fp, char *key, int tot,
-	        int this);
+	void (*print_numkey_entry)(FILE *fp, char *key, long long val,
+	                           char *link, int num);
+	void (*print_numkeybar_entry)(FILE *fp, char *key, long long max,
+	                              long long tot, long long this);
+	void (*print_numkeycomparativebar_entry)(FILE *fp, char *key,
+	        long long tot, long long this);
 	void (*print_bidimentional_map)(FILE *fp, int xlen, int ylen,
 	                                char **xlabel, char **ylabel, int *value);
 	void (*print_hline)(FILE *fp);
@@ -154,16 +313,27 @@ int Config_process_sites = 0;
 int Config_process_types = 0;
 int Config_process_hosts = 0;
 int Config_process_error404 = 0;
+int Config_process_cache = 0;	/* squid cache results */
 int Config_process_monthly_hits = 1;
 int Config_tail_mode = 0;
 int Config_stream_mode = 0;
+int Config_follow_mode = 0;
+int Config_merge_mode = 0;	/* arguments are snapshots to merge */
 int Config_update_every = 60*10; /* update every 10 minutes for default. */
 int Config_reset_every = 0;	/* never reset for default */
 int Config_time_delta = 0;	/* adjustable time difference */
 int Config_filter_spam = 0;
 int Config_ignore_404 = 0;
+int Config_threads = 1;		/* threads used to scan the files */
+int Config_index = 0;		/* use seek indexes for compressed files */
 char *Config_output_file = NULL; /* stdout if not set. */
+char *Config_state_file = NULL;	/* incremental runs if set. */
+char *Config_save_file = NULL;	/* snapshot to save, if set. */
+char *Config_load_file = NULL;	/* snapshot to load, if set. */
+struct vi_logformat *Config_log_format = NULL; /* see --log-format */
 struct outputmodule *Output = NULL; /* intialized to 'text' in main() */
+/* line parser, initialized in main() according to the log format */
+int (*Parser)(struct vih *vih, struct logline *ll, char *l, int len) = NULL;
 
 /* Prefixes */
 int Config_prefix_num = 0;	/* number of set prefixes */
@@ -181,7 +351,11 @@ static int vi_monthdays[12] = {31, 29, 31, 30, 31, 30 , 31, 31, 30, 31, 30, 31};
 
 /* -------------------------------- prototypes ------------------------------ */
 void vi_clear_error(struct vih *vih);
-void vi_tail(int filec, char **filev);
+int vi_parse_format(struct vih *vih, struct logline *ll, char *l, int len);
+int vi_parse_w3c(struct vih *vih, struct logline *ll, char *l, int len);
+int vi_parse_squid(struct vih *vih, struct logline *ll, char *l, int len);
+int vi_parse_json(struct vih *vih, struct logline *ll, char *l, int len);
+void vi_w3c_init(struct vi_w3c *w);
 
 /*------------------- Options parsing help functions ------------------------ */
 void ConfigAddGrepPattern(char *pattern, int type) {
@@ -230,6 +404,15 @@ int vi_is_internal_link(char *url) {
 	return 0;
 }
 
+/* Returns the current time in seconds, with microseconds resolution.
+ * Used to measure the throughput of the scan. */
+double vi_clock(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+
 /* returns non-zero if the URL 's' seems a real page. */
 int vi_is_pageview(char *s) {
 	int l = strlen(s);
@@ -276,6 +459,19 @@ int vi_is_numeric_address(char *ip) {
 	return strspn(ip, "0123456789.") == l;
 }
 
+/* Convert 't' in the local broken-down time 'tm' */
+void vi_localtime(time_t t, struct tm *tm) {
+#ifdef WIN32
+	struct tm *auxtm;
+
+	if ((auxtm = localtime(&t)) != NULL)
+		*tm = *auxtm;
+#else
+	/* The reentrant version is needed by --threads */
+	localtime_r(&t, tm);
+#endif
+}
+
 /* returns the time converted into a time_t value.
  * On error (time_t) -1 is returned.
  * Note that this function is specific for the following format:
@@ -357,18 +553,178 @@ time_t parse_date(char *s, struct tm *tmptr) {
 	t = mktime(&tm);
 	if (t == (time_t)-1) goto fmterr;
 	t += (Config_time_delta*3600);
-	if (tmptr) {
-		struct tm *auxtm;
-
-		if ((auxtm = localtime(&t)) != NULL)
-			*tmptr = *auxtm;
-	}
+	if (tmptr)
+		vi_localtime(t, tmptr);
 	return t;
 
 fmterr: /* format error */
 	return (time_t) -1;
 }
 
+char *vi_month_name[12] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+};
+
+/* Return the number of days from 1 Jan 1970 to the date 'd'/'m'/'y' of
+ * the proleptic gregorian calendar, 'm' in the 1-12 range. */
+int vi_days_from_civil(int y, int m, int d) {
+	int era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y-399) / 400;
+	yoe = y - era*400;
+	doy = (153*(m > 2 ? m-3 : m+9) + 2)/5 + d-1;
+	doe = yoe*365 + yoe/4 - yoe/100 + doy;
+	return era*146097 + doe - 719468;
+}
+
+/* The inverse of vi_days_from_civil() */
+void vi_civil_from_days(int z, int *y, int *m, int *d) {
+	int era, doe, yoe, doy, mp;
+
+	z += 719468;
+	era = (z >= 0 ? z : z-146096) / 146097;
+	doe = z - era*146097;
+	yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+	doy = doe - (yoe*365 + yoe/4 - yoe/100);
+	mp = (5*doy + 2)/153;
+	*d = doy - (153*mp + 2)/5 + 1;
+	*m = mp < 10 ? mp+3 : mp-9;
+	*y = yoe + era*400 + (*m <= 2);
+}
+
+/* Convert the date 's' in the log format "dd/Mon/yyyy", followed by
+ * anything, in the number of days and of months since 1 Jan 1970, with
+ * the same rules of parse_date(). Days and months are used to index the
+ * daily and monthly counters, so the time of the day, the timezone and
+ * --time-delta are ignored. Returns non-zero on format error. */
+int vi_date_index(char *s, int *day, int *month) {
+	char *p;
+	int d, m, y;
+
+	d = atoi(s);
+	if (d < 1 || d > 31) return 1;
+	if ((p = strchr(s, '/')) == NULL) return 1;
+	p++;
+	for (m = 0; m < 12; m++) {
+		if (tolower(p[0]) == tolower(vi_month_name[m][0]) &&
+		    tolower(p[1]) == vi_month_name[m][1] &&
+		    tolower(p[2]) == vi_month_name[m][2]) break;
+	}
+	if (m == 12) return 1;
+	if ((p = strchr(p, '/')) == NULL) return 1;
+	y = atoi(p+1);
+	if (y > 100) {
+		if (y < 1900 || y > 2500) return 1;
+	} else {
+		y += y < 69 ? 2000 : 1900;
+	}
+	*day = vi_days_from_civil(y, m+1, d);
+	*month = (y-1970)*12 + m;
+	return 0;
+}
+
+/* Fill the date cache entry 'dd' for the day 'key', "dd/Mon/yyyy".
+ * Days where the local time is not regular (DST changes in the day or
+ * in the local days it is shifted to by --time-delta) are marked
+ * invalid: their lines always use parse_date(). Returns non-zero if the
+ * day can't be parsed. */
+int vi_dateday_fill(struct vi_dateday *dd, char *key) {
+	char buf[32];
+	struct tm last;
+	time_t end;
+	int sod;
+
+	memcpy(dd->key, key, 11);
+	dd->valid = 0;
+	memcpy(buf, key, 11);
+	strcpy(buf+11, ":00:00:00");
+	if ((dd->start = parse_date(buf, &dd->first)) == (time_t)-1)
+		return 1;
+	strcpy(buf+11, ":23:59:59");
+	if ((end = parse_date(buf, &last)) == (time_t)-1)
+		return 1;
+	if (vi_date_index(key, &dd->day, &dd->month))
+		return 1;
+	dd->valid = -1;
+	if (end - dd->start != 86399)
+		return 0;
+	dd->startsec = dd->first.tm_hour*3600 + dd->first.tm_min*60 +
+	               dd->first.tm_sec;
+	dd->split = 86400 - dd->startsec;
+	vi_localtime(dd->start + dd->split, &dd->next);
+	if (dd->next.tm_hour || dd->next.tm_min || dd->next.tm_sec)
+		return 0;
+	/* The last second of the day must be where it is expected,
+	 * otherwise the local time changed in the middle. */
+	if (dd->split > 86399) {
+		sod = dd->startsec + 86399;
+		if (last.tm_mday != dd->first.tm_mday) return 0;
+	} else {
+		sod = 86399 - dd->split;
+		if (last.tm_mday != dd->next.tm_mday) return 0;
+	}
+	if (last.tm_hour*3600 + last.tm_min*60 + last.tm_sec != sod)
+		return 0;
+	dd->valid = 1;
+	return 0;
+}
+
+#define vi_isdigit(c) ((c) >= '0' && (c) <= '9')
+
+/* Parse the date 's' of a log line, filling the time, the broken-down
+ * time, and the day and month indexes of 'll'. Dates in the
+ * "dd/Mon/yyyy:hh:mm:ss" form of the logs use the date cache of the
+ * handle: the day is converted once, and the time of the day is added
+ * to it. Other forms, and days that can't be cached, fall back to
+ * parse_date(). Returns non-zero on format error. */
+int vi_parse_logdate(struct vih *vih, char *s, struct logline *ll) {
+	struct vi_dateday *dd;
+	int h, m, sec, sod;
+
+	if (!vi_isdigit(s[0]) || !vi_isdigit(s[1]) || s[2] != '/' ||
+	    s[6] != '/' || s[11] != ':' ||
+	    !vi_isdigit(s[12]) || !vi_isdigit(s[13]) || s[14] != ':' ||
+	    !vi_isdigit(s[15]) || !vi_isdigit(s[16]) || s[17] != ':' ||
+	    !vi_isdigit(s[18]) || !vi_isdigit(s[19]) ||
+	    (s[20] != '\0' && s[20] != ' '))
+		goto slowpath;
+	dd = &vih->datecache[(s[1]*5 + s[4] + s[10]*3) &
+	                     (VI_DATECACHE_SIZE-1)];
+	if (dd->valid == 0 || memcmp(dd->key, s, 11)) {
+		if (vi_dateday_fill(dd, s))
+			return 1;
+	}
+	if (dd->valid != 1)
+		goto slowpath;
+	h = (s[12]-'0')*10 + (s[13]-'0');
+	m = (s[15]-'0')*10 + (s[16]-'0');
+	sec = (s[18]-'0')*10 + (s[19]-'0');
+	if (h > 23 || m > 59 || sec > 60)
+		return 1;
+	sod = h*3600 + m*60 + sec;
+	ll->time = dd->start + sod;
+	if (sod < dd->split) {
+		ll->tm = dd->first;
+		sod += dd->startsec;
+	} else {
+		ll->tm = dd->next;
+		sod -= dd->split;
+	}
+	ll->tm.tm_hour = sod/3600;
+	ll->tm.tm_min = (sod/60)%60;
+	ll->tm.tm_sec = sod%60;
+	ll->day = dd->day;
+	ll->month = dd->month;
+	return 0;
+
+slowpath:
+	if ((ll->time = parse_date(s, &ll->tm)) == (time_t)-1)
+		return 1;
+	return vi_date_index(s, &ll->day, &ll->month);
+}
+
 /* returns 1 if the given date is Saturday or Sunday.
  * Zero is otherwise returned. */
 int vi_is_weekend(char *s) {
@@ -678,13 +1034,89 @@ int vi_match(const char *pattern, const char *string, int nocase) {
 }
 
 /*-------------------------- visited handler functions --------------------- */
-/* Init the hashtable with methods suitable for an "occurrences counter" */
-void vi_ht_init(struct hashtable *ht) {
-	ht_init(ht);
-	ht_set_hash(ht, ht_hash_string);
-	ht_set_key_destructor(ht, ht_destructor_free);
-	ht_set_val_destructor(ht, ht_no_destructor);
-	ht_set_key_compare(ht, ht_compare_string);
+/* Initialize an empty series of counters */
+void vi_series_init(struct vi_series *sr) {
+	sr->first = 0;
+	sr->len = 0;
+	sr->counter = NULL;
+}
+
+/* Release the counters of the series, that is left empty */
+void vi_series_reset(struct vi_series *sr) {
+	free(sr->counter);
+	vi_series_init(sr);
+}
+
+/* Add 'n' to the counter 'idx' of the series, growing its range if
+ * needed. The range is at least doubled every time, with the spare
+ * counters on the side it grew, as days and months mostly grow in one
+ * direction. Return 0 on success, non-zero on out of memory. */
+int vi_series_incr(struct vi_series *sr, int idx, long long n) {
+	if (idx < sr->first || idx >= sr->first+sr->len) {
+		int first, last, len;
+		long long *counter;
+
+		if (sr->len == 0) {
+			first = idx;
+			len = 64;
+		} else {
+			first = idx < sr->first ? idx : sr->first;
+			last = idx >= sr->first+sr->len ? idx : sr->first+sr->len-1;
+			len = last-first+1;
+			if (len < sr->len*2) len = sr->len*2;
+			if (idx < sr->first) first = last-len+1;
+		}
+		if ((counter = calloc(len, sizeof(long long))) == NULL)
+			return 1;
+		if (sr->len)
+			memcpy(counter+(sr->first-first), sr->counter,
+			       sizeof(long long)*sr->len);
+		free(sr->counter);
+		sr->counter = counter;
+		sr->first = first;
+		sr->len = len;
+	}
+	sr->counter[idx-sr->first] += n;
+	return 0;
+}
+
+/* Return the value of the counter 'idx' of the series */
+long long vi_series_get(struct vi_series *sr, int idx) {
+	if (idx < sr->first || idx >= sr->first+sr->len)
+		return 0;
+	return sr->counter[idx-sr->first];
+}
+
+/* Return the number of non-zero counters of the series */
+int vi_series_used(struct vi_series *sr) {
+	int i, used = 0;
+
+	for (i = 0; i < sr->len; i++)
+		if (sr->counter[i]) used++;
+	return used;
+}
+
+/* Return the biggest counter of the series */
+long long vi_series_max(struct vi_series *sr) {
+	long long max = 0;
+	int i;
+
+	for (i = 0; i < sr->len; i++)
+		if (sr->counter[i] > max) max = sr->counter[i];
+	return max;
+}
+
+/* Sum the counters of the series 'src' into 'dst'.
+ * Return 0 on success, non-zero on out of memory. */
+int vi_series_merge(struct vi_series *dst, struct vi_series *src) {
+	int i;
+
+	for (i = 0; i < src->len; i++) {
+		if (src->counter[i] &&
+		    vi_series_incr(dst, src->first+i, src->counter[i]))
+			return 1;
+	}
+	return 0;
 }
 
 /* Reset the weekday/hour info in the visited handler. */
@@ -711,24 +1143,19 @@ void vi_reset_combined_maps(struct vih *vih) {
 /* Reset the hashtables from the handler, that are left
  * in a reusable state (but all empty). */
 void vi_reset_hashtables(struct vih *vih) {
-	ht_destroy(&vih->users_hits);
-	ht_destroy(&vih->users_size);
-	ht_destroy(&vih->hosts_hits);
-	ht_destroy(&vih->hosts_size);
-	ht_destroy(&vih->pages_hits);
-	ht_destroy(&vih->pages_size);
-	ht_destroy(&vih->sites_hits);
-	ht_destroy(&vih->sites_size);
-	ht_destroy(&vih->codes_hits);
-	ht_destroy(&vih->codes_size);
-	ht_destroy(&vih->verbs_hits);
-	ht_destroy(&vih->verbs_size);
-	ht_destroy(&vih->types_hits);
-	ht_destroy(&vih->types_size);
-	ht_destroy(&vih->month_hits);
-	ht_destroy(&vih->month_size);
-	ht_destroy(&vih->error404);
-	ht_destroy(&vih->date);
+	fht_destroy(&vih->users);
+	fht_destroy(&vih->hosts);
+	fht_destroy(&vih->pages);
+	fht_destroy(&vih->sites);
+	fht_destroy(&vih->codes);
+	fht_destroy(&vih->verbs);
+	fht_destroy(&vih->types);
+	fht_destroy(&vih->error404);
+	fht_destroy(&vih->results);
+	fht_arena_free(&vih->keys);
+	vi_series_reset(&vih->month_hits);
+	vi_series_reset(&vih->month_size);
+	vi_series_reset(&vih->date);
 }
 
 /* Reset handler informations to support --reset option in
@@ -754,24 +1181,27 @@ struct vih *vi_new(void) {
 	vih->blacklisted = 0;
 	vi_reset_combined_maps(vih);
 	vih->error = NULL;
-	vi_ht_init(&vih->users_hits);
-	vi_ht_init(&vih->users_size);
-	vi_ht_init(&vih->hosts_hits);
-	vi_ht_init(&vih->hosts_size);
-	vi_ht_init(&vih->pages_hits);
-	vi_ht_init(&vih->pages_size);
-	vi_ht_init(&vih->sites_hits);
-	vi_ht_init(&vih->sites_size);
-	vi_ht_init(&vih->codes_hits);
-	vi_ht_init(&vih->codes_size);
-	vi_ht_init(&vih->verbs_hits);
-	vi_ht_init(&vih->verbs_size);
-	vi_ht_init(&vih->types_hits);
-	vi_ht_init(&vih->types_size);
-	vi_ht_init(&vih->month_hits);
-	vi_ht_init(&vih->month_size);
-	vi_ht_init(&vih->error404);
-	vi_ht_init(&vih->date);
+	vih->workers = 0;
+	vih->workerstat = NULL;
+	vih->compressed_bytes = 0;
+	vih->uncompressed_bytes = 0;
+	vih->decomp_time = 0;
+	memset(vih->datecache, 0, sizeof(vih->datecache));
+	memset(vih->epochday, 0, sizeof(vih->epochday));
+	vi_w3c_init(&vih->w3c);
+	fht_arena_init(&vih->keys);
+	fht_init(&vih->users, &vih->keys);
+	fht_init(&vih->hosts, &vih->keys);
+	fht_init(&vih->pages, &vih->keys);
+	fht_init(&vih->sites, &vih->keys);
+	fht_init(&vih->codes, &vih->keys);
+	fht_init(&vih->verbs, &vih->keys);
+	fht_init(&vih->types, &vih->keys);
+	fht_init(&vih->error404, &vih->keys);
+	fht_init(&vih->results, &vih->keys);
+	vi_series_init(&vih->month_hits);
+	vi_series_init(&vih->month_size);
+	vi_series_init(&vih->date);
 	return vih;
 }
 
@@ -780,6 +1210,7 @@ void vi_free(struct vih *vih) {
 	if (!vih) return;
 	vi_reset_hashtables(vih);
 	vi_clear_error(vih);
+	free(vih->workerstat);
 	free(vih);
 }
 
@@ -790,99 +1221,60 @@ void vi_free(struct vih *vih) {
  * Return the value of hits after the increment or creation. If the
  * returned value is greater than one, the key was already seen.
  *
- * Return 0 on out of memory.
- *
- * NOTE: the pointer of the "value" part of the hashtable entry is
- * used as a counter casting it to a "long" integer. */
-int vi_counter_incr(struct hashtable *ht, char *key) {
-	char *k;
-	unsigned int idx;
-	int r;
-	long val;
+ * Return 0 on out of memory. */
+int vi_counter_incr(struct fht *ht, char *key) {
+	struct fht_entry *e;
+	int added;
 
-	r = ht_search(ht, key, &idx);
-	if (r == HT_NOTFOUND) {
-		k = strdup(key);
-		if (k == NULL) return 0;
-		if (ht_add(ht, k, (void*)1) != HT_OK) {
-			free(k);
-			return 0;
-		}
-		return 1;
-	} else {
-		val = (long) ht_value(ht, idx);
-		val++;
-		ht_value(ht, idx) = (void*) val;
-		return val;
-	}
+	if ((e = fht_insert_cached(ht, key, strlen(key), &added)) == NULL)
+		return 0;
+	return ++e->hits;
 }
 
 /* Similar to vi_counter_incr, but only read the old value of
  * the counter without to alter it. If the specified key does not
  * exists zero is returned. */
-int vi_counter_val(struct hashtable *ht, char *key) {
-	unsigned int idx;
-	int r;
-	long val;
+long long vi_counter_val(struct fht *ht, char *key) {
+	struct fht_entry *e = fht_find(ht, key, strlen(key));
 
-	r = ht_search(ht, key, &idx);
-	if (r == HT_NOTFOUND) {
-		return 0;
-	} else {
-		val = (long) ht_value(ht, idx);
-		return val;
-	}
+	return e ? e->hits : 0;
 }
 
-/* Add a new entry in the traffic hashtable. If the key does not
- * exists creates a new entry with the size, otherwise adds to
- * the old value.
- *
- * Return the value of size after the increment or creation. If the
- * returned value is greater than zero, the key was already seen.
- *
- * Return 0 on out of memory.
- *
- * NOTE: the pointer of the "value" part of the hashtable entry is
- * used as a total casting it to a "long" integer. */
-int vi_traffic_incr(struct hashtable *ht, char *key, long size) {
-	char *k;
-	unsigned int idx;
-	int r;
-	long val;
+/* Update the time of the first and of the last request of the entry
+ * with 'first' and 'last', where zero means unknown. */
+void vi_entry_seen(struct fht_entry *e, long long first, long long last) {
+	if (first && (!e->first || first < e->first))
+		e->first = first;
+	if (last > e->last)
+		e->last = last;
+}
 
-	r = ht_search(ht, key, &idx);
-	if (r == HT_NOTFOUND) {
-		k = strdup(key);
-		if (k == NULL) return 0;
-		if (ht_add(ht, k, (void*)1) != HT_OK) {
-			free(k);
-			return 0;
-		}
+/* Count a request of 'size' bytes made at 'time' for the key: the hits
+ * and the traffic of the key are incremented with a single lookup, and
+ * the key is added if it does not exist.
+ *
+ * Return 0 on success, non-zero on out of memory. Note that unlike
+ * vi_counter_incr() the new total can't be used as return value, as
+ * a zero-sized request would be indistinguishable from an error. */
+int vi_traffic_incr(struct fht *ht, char *key, long long size, time_t time) {
+	struct fht_entry *e;
+	int added;
+
+	if ((e = fht_insert_cached(ht, key, strlen(key), &added)) == NULL)
 		return 1;
-	} else {
-		val = (long) ht_value(ht, idx);
-		val += size;
-		ht_value(ht, idx) = (void*) val;
-		return val;
-	}
+	e->hits++;
+	e->bytes += size;
+	vi_entry_seen(e, time, time);
+	return 0;
 }
 
 /* Similar to vi_traffic_incr, but only read the old value of
  * the size without altering it. If the specified key does not
  * exists zero is returned. */
-int vi_traffic_val(struct hashtable *ht, char *key) {
-	unsigned int idx;
-	int r;
-	long val;
+long long vi_traffic_val(struct fht *ht, char *key) {
+	struct fht_entry *e = fht_find(ht, key, strlen(key));
 
-	r = ht_search(ht, key, &idx);
-	if (r == HT_NOTFOUND) {
-		return 0;
-	} else {
-		val = (long) ht_value(ht, idx);
-		return val;
-	}
+	return e ? e->bytes : 0;
 }
 
 /* Set a key/value pair inside the hash table with
@@ -951,6 +1343,106 @@ int vi_replace_if_newer(struct hashtable *ht, char *key, time_t time) {
 	return vi_replace_time(ht, key, time, 0);
 }
 
+/* Sum the counters of the hashtable 'src' into 'dst'.
+ *
+ * Return 0 on success, non-zero on out of memory. */
+int vi_merge_counters(struct fht *dst, struct fht *src) {
+	unsigned int i;
+
+	for (i = 0; i < fht_size(src); i++) {
+		struct fht_entry *e = fht_entry(src, i), *d;
+		int added;
+
+		if (!fht_busy(src, i)) continue;
+		if ((d = fht_insert(dst, e->key, e->len, &added)) == NULL)
+			return 1;
+		d->hits += e->hits;
+		d->bytes += e->bytes;
+		vi_entry_seen(d, e->first, e->last);
+	}
+	dst->lookups += src->lookups;
+	dst->cachehits += src->cachehits;
+	return 0;
+}
+
+/* Names of the hashtables of the handle, in the vi_get_tables() order */
+char *vi_table_names[VI_TABLES] = {
+	"pages", "sites", "users", "hosts", "codes", "verbs", "types",
+	"error404", "results"
+};
+
+/* Store in 't' the pointers to the VI_TABLES hashtables of the handle,
+ * always in the same order. */
+void vi_get_tables(struct vih *vih, struct fht **t) {
+	t[0] = &vih->pages;
+	t[1] = &vih->sites;
+	t[2] = &vih->users;
+	t[3] = &vih->hosts;
+	t[4] = &vih->codes;
+	t[5] = &vih->verbs;
+	t[6] = &vih->types;
+	t[7] = &vih->error404;
+	t[8] = &vih->results;
+}
+
+/* Store in 's' the pointers to the VI_SERIES series of the handle,
+ * always in the same order. */
+void vi_get_series(struct vih *vih, struct vi_series **s) {
+	s[0] = &vih->date;
+	s[1] = &vih->month_hits;
+	s[2] = &vih->month_size;
+}
+
+/* Merge the statistics collected in the handle 'src' into 'dst'.
+ * This is used to join the results of handles filled in parallel.
+ * After this call 'src' should only be released with vi_free().
+ *
+ * Return 0 on success, non-zero on out of memory. */
+int vi_merge(struct vih *dst, struct vih *src) {
+	struct fht *dtables[VI_TABLES], *stables[VI_TABLES];
+	struct vi_series *dseries[VI_SERIES], *sseries[VI_SERIES];
+	unsigned int i, j;
+
+	if (src->startt < dst->startt) dst->startt = src->startt;
+	if (src->endt > dst->endt) dst->endt = src->endt;
+	dst->processed += src->processed;
+	dst->invalid += src->invalid;
+	dst->blacklisted += src->blacklisted;
+	dst->compressed_bytes += src->compressed_bytes;
+	dst->uncompressed_bytes += src->uncompressed_bytes;
+	dst->decomp_time += src->decomp_time;
+	for (i = 0; i < 24; i++) {
+		dst->hour_hits[i] += src->hour_hits[i];
+		dst->hour_size[i] += src->hour_size[i];
+		for (j = 0; j < 7; j++) {
+			dst->weekdayhour_hits[j][i] += src->weekdayhour_hits[j][i];
+			dst->weekdayhour_size[j][i] += src->weekdayhour_size[j][i];
+		}
+	}
+	for (i = 0; i < 7; i++) {
+		dst->weekday_hits[i] += src->weekday_hits[i];
+		dst->weekday_size[i] += src->weekday_size[i];
+	}
+	for (i = 0; i < 31; i++)
+		for (j = 0; j < 12; j++) {
+			dst->monthday_hits[j][i] += src->monthday_hits[j][i];
+			dst->monthday_size[j][i] += src->monthday_size[j][i];
+		}
+	vi_get_tables(dst, dtables);
+	vi_get_tables(src, stables);
+	for (i = 0; i < VI_TABLES; i++) {
+		if (vi_merge_counters(dtables[i], stables[i]))
+			return 1;
+	}
+	vi_get_series(dst, dseries);
+	vi_get_series(src, sseries);
+	for (i = 0; i < VI_SERIES; i++) {
+		if (vi_series_merge(dseries[i], sseries[i]))
+			return 1;
+	}
+	return 0;
+}
+
 /* Set an error in the visitors handle */
 void vi_set_error(struct vih *vih, char *fmt, ...) {
 	va_list ap;
@@ -979,6 +1471,20 @@ void vi_clear_error(struct vih *vih) {
 }
 
 /*----------------------------------- parsing   ----------------------------- */
+/* Parse the size of a request: the leading decimal digits at 'p', in
+ * bytes. Dashes and other non digits count as zero, and sizes bigger
+ * than VI_SIZE_MAX are clamped. */
+long long vi_parse_size(char *p) {
+	long long size = 0;
+
+	while (*p >= '0' && *p <= '9') {
+		size = size*10 + (*p++ - '0');
+		if (size > VI_SIZE_MAX)
+			return VI_SIZE_MAX;
+	}
+	return size;
+}
+
 /* Parse a line of log, and fill the logline structure with
  * appropriate values. On error (bad line format) non-zero is returned.
  * sample line from apache http log
@@ -987,98 +1493,81 @@ void vi_clear_error(struct vih *vih) {
  * sample line from kerio winroute http log
  * 192.168.206.15 - Admin [16/Feb/2011:17:19:57 -0500] "GET http://wc.cmc.com.cu:3000/WorldClient.dll?View=Logout HTTP/1.1" 200 10870 +3
  * host - user [date:time timezone] "verb url ver" code size +connections
- */
-int vi_parse_line(struct logline *ll, char *l) {
-	char *date, *hour, *timezone, *host, *req, *p, *user = NULL, *code, *size, *verb = NULL;
-	char *req_end = NULL, *user_end = NULL; //, *code_end = NULL, *size_end = NULL;
-
-	/* Seek the start of the different components */
-
-	/* host */
+ *
+ * The line is tokenized in a single left to right walk: every field is
+ * nul-terminated as soon as its end is found, and the fields inside the
+ * date and the request are split while they are scanned. Any verb is
+ * accepted, and everything after the size is ignored, so the size may
+ * also end the line. The walk jumps from a delimiter to the next one
+ * using the bitmasks built by the vectorized kernel of delim.c. */
+int vi_parse_line(struct vih *vih, struct logline *ll, char *l, int len) {
+	char *p, *host, *user, *date, *hour, *timezone;
+	char *req, *verb = NULL, *reqsp, *versp, *code;
+	long long size = 0;
+	struct vi_delim d;
+
+	vi_delim_init(&d, l, len);
+	/* host, up to the first space */
 	host = l;
-	/* date */
-	if ((date = strchr(l, '[')) == NULL) return 1;
-	user_end = date;
-	date++;
-	/* user */
-	user_end--;
-	/* Find user start by searching backwards until we find the space after first dash */
-	p = user_end;
-	p--;
-	while (p >= l) {
-		if (*p == ' ') {
-			user = p;
-			break;
-		}
-		p--;
+	p = vi_delim_next(&d, l);
+	while (p != NULL && *p != ' ') {
+		if (*p == '[') return 1;
+		p = vi_delim_next(&d, p+1);
 	}
-	if (p != 0) {
-		user++;
-	} else {
+	if (p == NULL) return 1;
+	*p++ = '\0';
+	/* user, the last field before the date. The identity field
+	 * that usually precedes it is skipped. */
+	user = p;
+	while ((p = vi_delim_next(&d, p)) != NULL && *p != '[') {
+		if (*p == ' ' && p[1] != '[') user = p+1;
+		p++;
+	}
+	if (p == NULL) return 1;
+	if (p > user)
+		p[-1] = '\0';
+	else
 		user = "";
+	/* date, with the hour after the first ':' and the timezone
+	 * after the next space */
+	date = ++p;
+	if ((p = vi_delim_find(&d, p, ']')) == NULL) return 1;
+	*p++ = '\0';
+	if (vi_parse_logdate(vih, date, ll)) return 1;
+	if ((hour = strchr(date, ':')) == NULL) return 1;
+	if ((timezone = strchr(hour, ' ')) == NULL) return 1;
+	*hour++ = '\0';
+	*timezone++ = '\0';
+	/* req, the quoted field after the date: "verb url version" */
+	while (*p == ' ') p++;
+	if (*p != '"') return 1;
+	req = ++p;
+	if ((p = vi_delim_next(&d, p)) == NULL) return 1;
+	reqsp = versp = NULL;
+	while (*p != '"') {
+		if (*p == ' ') {
+			if (reqsp == NULL) reqsp = p;
+			else if (versp == NULL) versp = p;
+		}
+		if ((p = vi_delim_next(&d, p+1)) == NULL) return 1;
 	}
-
-	/* req */
-	if ((req = strstr(l, "\"GET")) != NULL ||
-	        (req = strstr(l, "\"POST")) != NULL ||
-	        (req = strstr(l, "\"HEAD")) != NULL ||
-	        (req = strstr(l, "\"CONNECT")) != NULL ||
-	        (req = strstr(l, "\"PUT")) != NULL ||
-	        (req = strstr(l, "\"PROPFIND")) != NULL ||
-	        (req = strstr(l, "\"OPTIONS")) != NULL ||
-	        (req = strstr(l, "\"get")) != NULL ||
-	        (req = strstr(l, "\"post")) != NULL ||
-	        (req = strstr(l, "\"head")) != NULL ||
-	        (req = strstr(l, "\"connect")) != NULL ||
-	        (req = strstr(l, "\"put")) != NULL ||
-	        (req = strstr(l, "\"propfind")) != NULL ||
-	        (req = strstr(l, "\"options")) != NULL) {
-		req++;
-	} else {
-		req = "";
-	}
-
-	/* Nul-term the components */
-
-	/* host */
-	if ((p = strchr(host, ' ')) == NULL) return 1;
-	*p = '\0';
-	/* user */
-	*user_end = '\0';
-	/* date */
-	if ((p = strchr(date, ']')) == NULL) return 1;
-	*p = '\0';
-	ll->time = parse_date(date, &ll->tm);
-	if (ll->time == (time_t)-1) return 1;
-	/* hour */
-	if ((p = strchr(date, ':')) == NULL) return 1;
-	hour = p+1;
-	*p = '\0';
-	/* timezone */
-	if ((p = strchr(hour, ' ')) == NULL) return 1;
-	timezone = p+1;
-	*p = '\0';
-	/* req */
-	if ((p = strchr(req, '"')) == NULL) return 1;
-	req_end = p;
-	*p = '\0';
-	/* code */
-	code = p+2;
-	if ((p = strchr(code, ' ')) == NULL) return 1;
-	*p = '\0';
-	/* size */
-	size = p+1;
-	if ((p = strchr(size, ' ')) == NULL) return 1;
-	*p = '\0';
-	/* verb */
-	if ((p = strchr(req, ' ')) != NULL) {
+	*p++ = '\0';
+	if (reqsp != NULL) {
 		verb = req;
-		*p = '\0';
-		req = p+1;
+		*reqsp = '\0';
+		req = reqsp+1;
 		/* strip http ver */
-		if ((p = strchr(req, ' ')) != NULL)
-			*p = '\0';
+		if (versp != NULL)
+			*versp = '\0';
 	}
+	/* code, exit if we got an http code with more than 3 digits */
+	if (*p++ != ' ') return 1;
+	code = p;
+	if ((p = vi_delim_find(&d, p, ' ')) == NULL) return 1;
+	if (p-code > 3) return 1;
+	*p++ = '\0';
+	/* size, up to the next space or the end of the line */
+	size = vi_parse_size(p);
 
 	/* Fill the structure */
 	ll->host = host;
@@ -1088,99 +1577,918 @@ int vi_parse_line(struct logline *ll, char *l) {
 	ll->timezone = timezone;
 	ll->req = req;
 	ll->verb = verb;
-	// convert size to KB for storage by shifting right 10 bits to avoid overflow
-	ll->size = atol(size) >> 10;
-/*	// convert size to MB for storage by shifting right 20 bits to avoid overflow
-	ll->size = atol(size) >> 20;*/
-	// exit if we got an http code with more than 3 digits
-	if (strlen(code) > 3) return 1;
+	ll->size = size;
 	ll->code = code;
 	return 0;
 }
 
-/* process the weekday and hour information */
-void vi_process_date_and_hour(struct vih *vih, int weekday, int hour, long size) {
-	/* Note, the following sanity check is useless in theory. */
-	if (weekday < 0 || weekday > 6 || hour < 0 || hour > 23) return;
-	vih->weekday_hits[weekday]++;
-	vih->weekday_size[weekday] += size;
-	vih->hour_hits[hour]++;
-	vih->hour_size[hour] += size;
-	/* store the combined info. We always compute this information
-	 * even if the report is disabled because it's cheap. */
-	vih->weekdayhour_hits[weekday][hour]++;
-	vih->weekdayhour_size[weekday][hour] += size;
-}
+/* -------------------------------- log formats ----------------------------- */
+/* Logs in a layout different from the one vi_parse_line() expects can be
+ * described with --log-format, using the directives of the LogFormat of
+ * Apache. The format is compiled once into a list of steps, literals to
+ * match and fields to extract, so that no format string is interpreted
+ * while the lines are parsed.
+ *
+ * Formats that describe themselves, like the W3C extended format of IIS,
+ * or that carry more than the directives can describe, like the cache
+ * result codes of squid, have a parser of their own instead. */
+struct vi_logformat_preset {
+	char *name;
+	char *format;		/* NULL if the format has its own parser */
+	int (*parser)(struct vih *vih, struct logline *ll, char *l, int len);
+};
 
-/* process the month and day information */
-void vi_process_month_and_day(struct vih *vih, int month, int day, long size) {
-	if (month < 0 || month > 11 || day < 0 || day > 30) return;
-	vih->monthday_hits[month][day]++;
-	vih->monthday_size[month][day] += size;
-}
+struct vi_logformat_preset vi_logformat_presets[] = {
+	{"common", "%h %l %u %t \"%r\" %>s %b", vi_parse_format},
+	{"combined", "%h %l %u %t \"%r\" %>s %b \"%{Referer}i\" \"%{User-agent}i\"",
+	 vi_parse_format},
+	{"winroute", "%h %l %u %t \"%r\" %>s %b +%{connections}n",
+	 vi_parse_format},
+	{"squid", NULL, vi_parse_squid},
+	{"w3c", NULL, vi_parse_w3c},
+	{"iis", NULL, vi_parse_w3c},
+	{"json", NULL, vi_parse_json},
+	{NULL, NULL, NULL}
+};
 
-/* Process requests populating the pages and sites hash tables.
- * Populate also date and month hash tables if requested 
- * Return non-zero on out of memory. */
-int vi_process_requests(struct vih *vih, char *req, long size, char *date) {
-	char *p, *site = NULL, *month = "fixme if I'm here!";
-	int res;
+/* Add a step of type 'type' to the format 'f'. Literals are joined with
+ * the previous literal step. Returns non-zero if the format is too long
+ * or on out of memory. */
+int vi_logformat_add(struct vi_logformat *f, int type, char *lit, int len) {
+	struct vi_fmtstep *st;
 
-	/* Don't count internal links (specified by the user
-	 * using --prefix options) */
-	if (vi_is_internal_link(req)) {
-		res = vi_traffic_incr(&vih->pages_size, "Internal Link", size);
-		if (res == 0) return 1;
-		res = vi_counter_incr(&vih->pages_hits, "Internal Link");
-		if (res == 0) return 1;
+	if (type == VI_FMT_LITERAL && f->steps &&
+	    f->step[f->steps-1].type == VI_FMT_LITERAL) {
+		st = &f->step[f->steps-1];
+		if ((st->lit = realloc(st->lit, st->len+len)) == NULL)
+			return 1;
+		memcpy(st->lit+st->len, lit, len);
+		st->len += len;
 		return 0;
 	}
-	res = vi_traffic_incr(&vih->pages_size, req, size);
-	if (res == 0) return 1;
-	res = vi_counter_incr(&vih->pages_hits, req);
-	if (res == 0) return 1;
+	if (f->steps == VI_LOGFORMAT_STEPS) return 1;
+	st = &f->step[f->steps++];
+	st->type = type;
+	st->lit = NULL;
+	st->len = 0;
+	st->term = 0;
+	if (type == VI_FMT_LITERAL) {
+		if ((st->lit = malloc(len)) == NULL) return 1;
+		memcpy(st->lit, lit, len);
+		st->len = len;
+	}
+	return 0;
+}
 
-	/* sites */
-	if (Config_process_sites) {
-		if ((p = strchr(req, '/')) != NULL) {
-			site = p+2;
-			/* strip http ver */
-			if ((p = strchr(site, '/')) != NULL) {
-				// this modifies url so we have to restore it below to avoid side effects
-				*p = '\0';
-				res = vi_traffic_incr(&vih->sites_size, site, size);
-				if (res == 0) return 1;
-				res = vi_counter_incr(&vih->sites_hits, site);
-				if (res == 0) return 1;
-				// restore url to avoid interfering with functions called after this 
-				*p = '/';
+/* Compile the log format 'spec', the name of a preset or a format made
+ * of the following directives of the Apache LogFormat, and of literal
+ * text:
+ *
+ * %h %a remote host, %u remote user, %t time as [dd/Mon/yyyy:hh:mm:ss zone]
+ * %{sec}t %{msec}t seconds or milliseconds since the epoch,
+ * %r request line, %m method, %U url, %s %>s status, %b %B %O size,
+ * %% a percent sign. Any other directive, like %l or %{Referer}i, is a
+ * field that is skipped.
+ *
+ * A space in the format matches any number of spaces, and a field ends
+ * at the first occurrence of the character that follows it in the
+ * format, so two fields must be separated by some literal text.
+ * Returns NULL on error, with the reason in 'err'. */
+struct vi_logformat *vi_logformat_compile(char *spec, char **err) {
+	struct vi_logformat *f;
+	struct vi_logformat_preset *preset;
+	char *p, *arg;
+	int arglen, type, i;
+
+	*err = "Out of memory";
+	if ((f = malloc(sizeof(*f))) == NULL) return NULL;
+	f->name = spec;
+	f->parser = vi_parse_format;
+	f->steps = 0;
+	for (preset = vi_logformat_presets; preset->name; preset++) {
+		if (!strcasecmp(spec, preset->name)) {
+			f->parser = preset->parser;
+			spec = preset->format;
+			break;
+		}
+	}
+	if (spec == NULL) return f;
+	for (p = spec; *p; p++) {
+		if (*p != '%' || p[1] == '%') {
+			if (vi_logformat_add(f, VI_FMT_LITERAL, p, 1)) goto toolong;
+			if (*p == '%') p++;
+			continue;
+		}
+		p++;
+		/* Conditions and modifiers, like %>s or %400,501{Referer}i,
+		 * don't matter here. */
+		while (*p == '<' || *p == '>' || *p == '!' || *p == ',' ||
+		       (*p >= '0' && *p <= '9'))
+			p++;
+		arg = NULL;
+		arglen = 0;
+		if (*p == '{') {
+			arg = ++p;
+			if ((p = strchr(p, '}')) == NULL) {
+				*err = "Unterminated %{ in the log format";
+				goto err;
+			}
+			arglen = p-arg;
+			p++;
+		}
+		switch(*p) {
+		case 'h': case 'a': type = VI_FMT_HOST; break;
+		case 'u': type = VI_FMT_USER; break;
+		case 'r': type = VI_FMT_REQUEST; break;
+		case 'm': type = VI_FMT_METHOD; break;
+		case 'U': type = VI_FMT_URL; break;
+		case 's': type = VI_FMT_STATUS; break;
+		case 'b': case 'B': case 'O': type = VI_FMT_SIZE; break;
+		case 't':
+			if (arg == NULL)
+				type = VI_FMT_TIME;
+			else if (arglen == 3 && !memcmp(arg, "sec", 3))
+				type = VI_FMT_EPOCH;
+			else if (arglen == 4 && !memcmp(arg, "msec", 4))
+				type = VI_FMT_EPOCHMS;
+			else {
+				*err = "Unsupported time format in the log format";
+				goto err;
 			}
+			break;
+		case '\0':
+			*err = "Incomplete directive at the end of the log format";
+			goto err;
+		default: type = VI_FMT_SKIP; break;
+		}
+		if (f->steps && f->step[f->steps-1].type != VI_FMT_LITERAL) {
+			*err = "Fields not separated by text in the log format";
+			goto err;
 		}
+		if (vi_logformat_add(f, type, NULL, 0)) goto toolong;
 	}
+	if (f->steps == 0) {
+		*err = "Empty log format";
+		goto err;
+	}
+	/* Every field but the last ends where the next literal starts */
+	for (i = 0; i < f->steps-1; i++) {
+		if (f->step[i].type != VI_FMT_LITERAL)
+			f->step[i].term = f->step[i+1].lit[0];
+	}
+	return f;
 
-	/* daily hits */
-	res = vi_counter_incr(&vih->date, date);
-	if (res == 0) return 1;
-	/* monthly hits */
-	if (Config_process_monthly_hits) {
-		/* Skip the day number. */
-		month = strchr(date, '/');
-		if (!month) return 0; /* should never happen */
-		month++;
-		res = vi_counter_incr(&vih->month_hits, month);
-		if (res == 0) return 1;
-		res = vi_traffic_incr(&vih->month_size, month, size);
-		if (res == 0) return 1;
+toolong:
+	*err = "Log format too long";
+err:
+	for (i = 0; i < f->steps; i++)
+		free(f->step[i].lit);
+	free(f);
+	return NULL;
+}
+
+/* Convert the epoch time 't' in the local broken-down time 'tm' like
+ * localtime() does. The local day of the last conversion is cached in
+ * 'ed', so that times in the same day are converted arithmetically. */
+void vi_epoch_localtime(struct vi_epochday *ed, time_t t, struct tm *tm) {
+	struct tm last;
+	int sod;
+
+	if (ed->valid && t >= ed->start && t < ed->start+86400) {
+		sod = t - ed->start;
+		*tm = ed->tm;
+		tm->tm_hour = sod/3600;
+		tm->tm_min = (sod/60)%60;
+		tm->tm_sec = sod%60;
+		return;
 	}
-	return 0;
+	vi_localtime(t, tm);
+	ed->valid = 0;
+	ed->start = t - (tm->tm_hour*3600 + tm->tm_min*60 + tm->tm_sec);
+	/* Only days that are 24 hours long, without DST changes */
+	vi_localtime(ed->start, &ed->tm);
+	if (ed->tm.tm_hour || ed->tm.tm_min || ed->tm.tm_sec) return;
+	vi_localtime(ed->start+86399, &last);
+	if (last.tm_mday != ed->tm.tm_mday || last.tm_hour != 23 ||
+	    last.tm_min != 59 || last.tm_sec != 59) return;
+	ed->valid = 1;
 }
 
-/* Process requests populating the types hash table.
- * Return non-zero on out of memory. */
-int vi_process_types(struct vih *vih, char *url, long size) {
-	int res, c;
-	char *dot, *p;
-	char urldecoded[VI_LINE_MAX];
+/* Fill the time related fields of 'll' for a line logged at the epoch
+ * time 't'. The day and the month are the local ones of 't', the time
+ * is shifted by --time-delta. */
+void vi_epoch_fill(struct vih *vih, struct logline *ll, time_t t) {
+	struct tm tm;
+
+	vi_epoch_localtime(&vih->epochday[0], t, &tm);
+	ll->day = vi_days_from_civil(tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday);
+	ll->month = (tm.tm_year-70)*12 + tm.tm_mon;
+	ll->time = t + Config_time_delta*3600;
+	vi_epoch_localtime(&vih->epochday[1], ll->time, &ll->tm);
+	ll->date = ll->hour = ll->timezone = "";
+}
+
+/* Parse a line of log with the --log-format compiled in
+ * Config_log_format, filling the logline structure like
+ * vi_parse_line() does. On error (line not matching the format)
+ * non-zero is returned. */
+int vi_parse_format(struct vih *vih, struct logline *ll, char *l, int len) {
+	struct vi_logformat *f = Config_log_format;
+	char *start[VI_FMT_SKIP+1], *stop[VI_FMT_SKIP+1];
+	char *p = l, *end = l+len, *e, *date;
+	long long size = 0;
+	time_t t = 0;
+	int i, j;
+
+	/* The newline left by fgets() is not part of the last field */
+	while (end > l && (end[-1] == '\n' || end[-1] == '\r'))
+		end--;
+	memset(start, 0, sizeof(start));
+	for (i = 0; i < f->steps; i++) {
+		struct vi_fmtstep *st = &f->step[i];
+
+		switch(st->type) {
+		case VI_FMT_LITERAL:
+			for (j = 0; j < st->len; j++) {
+				if (p == end) return 1;
+				if (st->lit[j] == ' ') {
+					if (*p != ' ') return 1;
+					while (p < end && *p == ' ') p++;
+				} else if (*p++ != st->lit[j]) {
+					return 1;
+				}
+			}
+			continue;
+		case VI_FMT_TIME:
+			if (p == end || *p != '[') return 1;
+			p++;
+			if ((e = memchr(p, ']', end-p)) == NULL) return 1;
+			start[st->type] = p;
+			stop[st->type] = e;
+			p = e+1;
+			continue;
+		}
+		if (st->term == 0) {
+			for (e = p; e < end && *e != ' '; e++);
+		} else {
+			if ((e = memchr(p, st->term, end-p)) == NULL) return 1;
+			/* Apache escapes the quotes inside quoted fields */
+			while (st->term == '"' && e > p && e[-1] == '\\') {
+				if ((e = memchr(e+1, '"', end-e-1)) == NULL)
+					return 1;
+			}
+		}
+		start[st->type] = p;
+		stop[st->type] = e;
+		p = e;
+	}
+	/* Nul-terminate the fields only now, the characters after them
+	 * were needed to match the literals */
+	for (i = 0; i <= VI_FMT_SKIP; i++)
+		if (start[i]) *stop[i] = '\0';
+
+	/* time */
+	if ((date = start[VI_FMT_TIME]) != NULL) {
+		if (vi_parse_logdate(vih, date, ll)) return 1;
+		ll->date = date;
+		ll->hour = ll->timezone = "";
+		if ((p = strchr(date, ':')) != NULL) {
+			*p++ = '\0';
+			ll->hour = p;
+			if ((p = strchr(p, ' ')) != NULL) {
+				*p++ = '\0';
+				ll->timezone = p;
+			}
+		}
+	} else if ((p = start[VI_FMT_EPOCH]) != NULL ||
+	           (p = start[VI_FMT_EPOCHMS]) != NULL) {
+		if (*p < '0' || *p > '9') return 1;
+		while (*p >= '0' && *p <= '9')
+			t = t*10 + (*p++ - '0');
+		if (start[VI_FMT_EPOCHMS]) t /= 1000;
+		vi_epoch_fill(vih, ll, t);
+	} else {
+		return 1;
+	}
+	/* request */
+	ll->verb = start[VI_FMT_METHOD];
+	ll->req = start[VI_FMT_URL] ? start[VI_FMT_URL] : "";
+	if ((p = start[VI_FMT_REQUEST]) != NULL) {
+		ll->verb = NULL;
+		ll->req = p;
+		if ((p = strchr(p, ' ')) != NULL) {
+			ll->verb = ll->req;
+			*p++ = '\0';
+			ll->req = p;
+			/* strip http ver */
+			if ((p = strchr(p, ' ')) != NULL)
+				*p = '\0';
+		}
+	}
+	ll->host = start[VI_FMT_HOST] ? start[VI_FMT_HOST] : "";
+	ll->user = start[VI_FMT_USER] ? start[VI_FMT_USER] : "-";
+	// exit if we got an http code with more than 3 digits
+	ll->code = start[VI_FMT_STATUS] ? start[VI_FMT_STATUS] : "";
+	if (strlen(ll->code) > 3) return 1;
+	if (start[VI_FMT_SIZE] != NULL)
+		size = vi_parse_size(start[VI_FMT_SIZE]);
+	ll->size = size;
+	return 0;
+}
+
+/* ---------------------------- W3C extended logs --------------------------- */
+/* The W3C extended format, written by IIS and by other servers, declares
+ * the fields of its lines in "#Fields:" directives, that can appear again
+ * in the middle of a file (IIS writes them again every time the server
+ * is restarted). The layout of the current directive is kept in the
+ * handle, so that every line is split once in space separated columns
+ * and every column goes straight to its field. Times are in UTC. */
+struct vi_w3c_name {
+	char *name;
+	int field;
+};
+
+struct vi_w3c_name vi_w3c_names[] = {
+	{"date", VI_W3C_DATE},
+	{"time", VI_W3C_TIME},
+	{"c-ip", VI_W3C_HOST},
+	{"cs-username", VI_W3C_USER},
+	{"cs-method", VI_W3C_METHOD},
+	{"cs-uri-stem", VI_W3C_URL},
+	{"cs-uri", VI_W3C_URL},
+	{"cs-uri-query", VI_W3C_QUERY},
+	{"sc-status", VI_W3C_STATUS},
+	{"sc-bytes", VI_W3C_SIZE},
+	{NULL, 0}
+};
+
+/* Initialize 'w' to the layout of a log without directives */
+void vi_w3c_init(struct vi_w3c *w) {
+	w->columns = 0;
+	w->day = -1;
+}
+
+/* Return the value of the 'n' decimal digits at 's', or -1 if they are
+ * not all digits. */
+int vi_w3c_num(char *s, int n) {
+	int v = 0;
+
+	while (n--) {
+		if (*s < '0' || *s > '9') return -1;
+		v = v*10 + (*s++ - '0');
+	}
+	return v;
+}
+
+/* Convert the W3C date "yyyy-mm-dd" at 's' in days since the epoch.
+ * Returns -1 on format error. */
+int vi_w3c_date(char *s, char *end) {
+	int y, m, d;
+
+	if (end-s < 10 || s[4] != '-' || s[7] != '-') return -1;
+	y = vi_w3c_num(s, 4);
+	m = vi_w3c_num(s+5, 2);
+	d = vi_w3c_num(s+8, 2);
+	if (y < 1970 || m < 1 || m > 12 || d < 1 || d > 31) return -1;
+	return vi_days_from_civil(y, m, d);
+}
+
+/* Convert the W3C time "hh:mm:ss" at 's', maybe followed by a fraction
+ * of second, in seconds since midnight. Returns -1 on format error. */
+int vi_w3c_time(char *s, char *end) {
+	int h, m, sec;
+
+	if (end-s < 8 || s[2] != ':' || s[5] != ':') return -1;
+	h = vi_w3c_num(s, 2);
+	m = vi_w3c_num(s+3, 2);
+	sec = vi_w3c_num(s+6, 2);
+	if (h < 0 || h > 23 || m < 0 || m > 59 || sec < 0 || sec > 60)
+		return -1;
+	return h*3600 + m*60 + sec;
+}
+
+/* Update the layout 'w' with the directive line 'l' ending at 'end'.
+ * Only #Fields: and #Date: matter, the other directives are ignored. */
+void vi_w3c_directive(struct vi_w3c *w, char *l, char *end) {
+	struct vi_w3c_name *n;
+	char *p;
+	int day;
+
+	while (end > l && (end[-1] == '\n' || end[-1] == '\r'))
+		end--;
+	if (end-l >= 6 && !memcmp(l, "#Date:", 6)) {
+		for (p = l+6; p < end && *p == ' '; p++);
+		if ((day = vi_w3c_date(p, end)) != -1)
+			w->day = day;
+		return;
+	}
+	if (end-l < 8 || memcmp(l, "#Fields:", 8)) return;
+	w->columns = 0;
+	p = l+8;
+	while (w->columns < VI_W3C_COLUMNS) {
+		char *name;
+
+		while (p < end && (*p == ' ' || *p == '\t')) p++;
+		if (p == end) break;
+		for (name = p; p < end && *p != ' ' && *p != '\t'; p++);
+		w->field[w->columns] = VI_W3C_SKIP;
+		for (n = vi_w3c_names; n->name; n++) {
+			if ((int)strlen(n->name) == p-name &&
+			    !strncasecmp(n->name, name, p-name)) {
+				w->field[w->columns] = n->field;
+				break;
+			}
+		}
+		w->columns++;
+	}
+}
+
+/* Update the layout 'w' with all the directives found in the 'len'
+ * bytes at 'buf', that must start at the beginning of a line. Used to
+ * know the layout at the start of a chunk of a file without parsing
+ * what precedes it. */
+void vi_w3c_scan(struct vi_w3c *w, char *buf, size_t len) {
+	char *p = buf, *end = buf+len, *nl;
+
+	while (p < end && (p = memchr(p, '#', end-p)) != NULL) {
+		if (p != buf && p[-1] != '\n') {
+			p++;
+			continue;
+		}
+		if ((nl = memchr(p, '\n', end-p)) == NULL) nl = end;
+		vi_w3c_directive(w, p, nl);
+		p = nl;
+	}
+}
+
+/* Parse a line of a W3C extended log with the layout of the last
+ * directive, filling the logline structure like vi_parse_line() does.
+ * Directive lines are not passed here, see vi_process_line().
+ * On error (no layout yet, or line not matching it) non-zero is
+ * returned. */
+int vi_parse_w3c(struct vih *vih, struct logline *ll, char *l, int len) {
+	struct vi_w3c *w = &vih->w3c;
+	struct vi_delim d;
+	char *start[VI_W3C_FIELDS], *stop[VI_W3C_FIELDS];
+	char *p = l, *end = l+len, *e, *query;
+	long long size = 0;
+	int i, day, sec = 0;
+
+	if (w->columns == 0) return 1;
+	while (end > l && (end[-1] == '\n' || end[-1] == '\r'))
+		end--;
+	memset(start, 0, sizeof(start));
+	vi_delim_init(&d, l, end-l);
+	for (i = 0; i < w->columns; i++) {
+		if (p > end) return 1;	/* less columns than declared */
+		if ((e = vi_delim_find(&d, p, ' ')) == NULL) e = end;
+		start[w->field[i]] = p;
+		stop[w->field[i]] = e;
+		p = e+1;
+	}
+	/* The query is appended to the url as in the request line. It
+	 * usually follows the url, then they are joined in place. */
+	query = start[VI_W3C_QUERY];
+	if (query && start[VI_W3C_URL] &&
+	    !(stop[VI_W3C_QUERY]-query == 1 && *query == '-')) {
+		if (stop[VI_W3C_URL]+1 == query) {
+			*stop[VI_W3C_URL] = '?';
+			stop[VI_W3C_URL] = stop[VI_W3C_QUERY];
+			query = NULL;
+		}
+	} else {
+		query = NULL;
+	}
+	/* time */
+	if (start[VI_W3C_DATE])
+		day = vi_w3c_date(start[VI_W3C_DATE], stop[VI_W3C_DATE]);
+	else
+		day = w->day;
+	if (day == -1) return 1;
+	if (start[VI_W3C_TIME] &&
+	    (sec = vi_w3c_time(start[VI_W3C_TIME], stop[VI_W3C_TIME])) == -1)
+		return 1;
+	for (i = VI_W3C_SKIP+1; i < VI_W3C_FIELDS; i++)
+		if (start[i]) *stop[i] = '\0';
+	vi_epoch_fill(vih, ll, (time_t)day*86400 + sec);
+	/* request */
+	ll->req = start[VI_W3C_URL] ? start[VI_W3C_URL] : "";
+	if (query) {
+		snprintf(vih->w3curl, VI_LINE_MAX, "%s?%s", ll->req, query);
+		ll->req = vih->w3curl;
+	}
+	ll->verb = start[VI_W3C_METHOD];
+	ll->host = start[VI_W3C_HOST] ? start[VI_W3C_HOST] : "";
+	ll->user = start[VI_W3C_USER] ? start[VI_W3C_USER] : "-";
+	// exit if we got an http code with more than 3 digits
+	ll->code = start[VI_W3C_STATUS] ? start[VI_W3C_STATUS] : "";
+	if (strlen(ll->code) > 3) return 1;
+	if (start[VI_W3C_SIZE] != NULL)
+		size = vi_parse_size(start[VI_W3C_SIZE]);
+	ll->size = size;
+	return 0;
+}
+
+/* -------------------------------- squid logs ------------------------------ */
+/* The native access.log of squid:
+ *
+ * time elapsed client result/status bytes method url user hierarchy type
+ *
+ * The time is the epoch with milliseconds, and the elapsed time is padded
+ * with spaces, so fields are separated by any number of spaces. The cache
+ * result code (TCP_HIT, TCP_MISS, ...) is kept for the cache reports. */
+#define VI_SQUID_FIELDS 10
+
+/* Parse a line of a squid log, filling the logline structure like
+ * vi_parse_line() does. On error non-zero is returned. */
+int vi_parse_squid(struct vih *vih, struct logline *ll, char *l, int len) {
+	struct vi_delim d;
+	char *f[VI_SQUID_FIELDS], *p = l, *end = l+len, *e;
+	time_t t = 0;
+	long long size = 0;
+	int n = 0;
+
+	while (end > l && (end[-1] == '\n' || end[-1] == '\r'))
+		end--;
+	vi_delim_init(&d, l, end-l);
+	while (n < VI_SQUID_FIELDS) {
+		while (p < end && *p == ' ') p++;
+		if (p == end) break;
+		if ((e = vi_delim_find(&d, p, ' ')) == NULL) e = end;
+		f[n++] = p;
+		*e = '\0';
+		p = e+1;
+	}
+	/* The user and the fields after it are optional */
+	if (n < 7) return 1;
+	/* time */
+	p = f[0];
+	if (*p < '0' || *p > '9') return 1;
+	while (*p >= '0' && *p <= '9')
+		t = t*10 + (*p++ - '0');
+	vi_epoch_fill(vih, ll, t);
+	/* result/status */
+	ll->result = f[3];
+	if ((p = strchr(f[3], '/')) == NULL) return 1;
+	*p++ = '\0';
+	// exit if we got an http code with more than 3 digits
+	ll->code = p;
+	if (strlen(ll->code) > 3) return 1;
+	size = vi_parse_size(f[4]);
+	ll->host = f[2];
+	ll->verb = f[5];
+	ll->req = f[6];
+	ll->user = n > 7 ? f[7] : "-";
+	ll->size = size;
+	return 0;
+}
+
+/* -------------------------------- JSON logs ------------------------------- */
+/* One JSON object per line, like the logs of nginx with escape=json.
+ * No tree is built: the line is scanned once, the members that are not
+ * needed are skipped, the values of the others are unescaped in place,
+ * and the scan stops as soon as every field was found. Strings are
+ * skipped jumping from a quote to the next one with the delimiter
+ * kernel, so long values cost about as much as in the NCSA parser. */
+#define VI_JSON_HOST	0
+#define VI_JSON_USER	1
+#define VI_JSON_TIME	2
+#define VI_JSON_REQUEST	3
+#define VI_JSON_STATUS	4
+#define VI_JSON_SIZE	5
+#define VI_JSON_FIELDS	6
+
+struct vi_json_name {
+	char *name;
+	int len;
+	int field;
+};
+
+struct vi_json_name vi_json_names[] = {
+	{"remote_addr", 11, VI_JSON_HOST},
+	{"remote_user", 11, VI_JSON_USER},
+	{"time", 4, VI_JSON_TIME},
+	{"time_local", 10, VI_JSON_TIME},
+	{"time_iso8601", 12, VI_JSON_TIME},
+	{"msec", 4, VI_JSON_TIME},
+	{"request", 7, VI_JSON_REQUEST},
+	{"status", 6, VI_JSON_STATUS},
+	{"bytes", 5, VI_JSON_SIZE},
+	{"body_bytes_sent", 15, VI_JSON_SIZE},
+	{"bytes_sent", 10, VI_JSON_SIZE},
+	{NULL, 0, 0}
+};
+
+/* Return the VI_JSON_* field of the member named by the 'len' bytes at
+ * 'key', or -1 if it is not needed. */
+int vi_json_field(char *key, int len) {
+	struct vi_json_name *n;
+
+	for (n = vi_json_names; n->name; n++) {
+		if (n->len == len && !memcmp(n->name, key, len))
+			return n->field;
+	}
+	return -1;
+}
+
+/* Return a pointer to the first character at or after 'p' that is not
+ * a blank */
+char *vi_json_ws(char *p, char *end) {
+	while (p < end && (*p == ' ' || *p == '\t')) p++;
+	return p;
+}
+
+/* Return a pointer to the quote closing the string that starts at 'p',
+ * just after the opening quote, or NULL if it is not closed. */
+char *vi_json_string_end(struct vi_delim *d, char *p) {
+	char *q = p, *b;
+
+	while ((q = vi_delim_find(d, q, '"')) != NULL) {
+		/* Escaped if preceded by an odd number of backslashes */
+		for (b = q; b > p && b[-1] == '\\'; b--);
+		if (((q-b) & 1) == 0) return q;
+		q++;
+	}
+	return NULL;
+}
+
+/* Return a pointer just after the value at 'p', that is a number, a
+ * literal, an object or an array, or NULL on syntax error. */
+char *vi_json_skip(struct vi_delim *d, char *p, char *end) {
+	int depth = 0;
+
+	for (; p < end; p++) {
+		switch(*p) {
+		case '"':
+			if ((p = vi_json_string_end(d, p+1)) == NULL)
+				return NULL;
+			break;
+		case '{': case '[':
+			depth++;
+			break;
+		case '}': case ']':
+			if (depth == 0) return p;
+			depth--;
+			break;
+		case ',': case ' ': case '\t':
+			if (depth == 0) return p;
+			break;
+		}
+	}
+	return depth ? NULL : p;
+}
+
+/* Return the value of the hex digit 'c', or -1 */
+int vi_json_hex(int c) {
+	if (c >= '0' && c <= '9') return c-'0';
+	if (c >= 'a' && c <= 'f') return c-'a'+10;
+	if (c >= 'A' && c <= 'F') return c-'A'+10;
+	return -1;
+}
+
+/* Unescape in place the JSON string 's' ending at 'end', returning its
+ * new end. The \xHH escapes of the default escaping of nginx are
+ * accepted too. */
+char *vi_json_unescape(char *s, char *end) {
+	char *w = s;
+	int c, i, h;
+
+	while (s < end) {
+		if (*s != '\\' || s+1 == end) {
+			*w++ = *s++;
+			continue;
+		}
+		s++;
+		switch(*s) {
+		case 'b': *w++ = '\b'; s++; break;
+		case 'f': *w++ = '\f'; s++; break;
+		case 'n': *w++ = '\n'; s++; break;
+		case 'r': *w++ = '\r'; s++; break;
+		case 't': *w++ = '\t'; s++; break;
+		case 'u':
+		case 'x':
+			h = *s == 'u' ? 4 : 2;
+			for (c = 0, i = 1; i <= h && s+i < end; i++) {
+				if (vi_json_hex(s[i]) == -1) break;
+				c = c*16 + vi_json_hex(s[i]);
+			}
+			if (i <= h) {
+				*w++ = *s++;
+				break;
+			}
+			s += h+1;
+			/* UTF-8 encoding of the code point */
+			if (c < 0x80 || h == 2) {
+				*w++ = c;
+			} else if (c < 0x800) {
+				*w++ = 0xc0 | (c >> 6);
+				*w++ = 0x80 | (c & 0x3f);
+			} else {
+				*w++ = 0xe0 | (c >> 12);
+				*w++ = 0x80 | ((c >> 6) & 0x3f);
+				*w++ = 0x80 | (c & 0x3f);
+			}
+			break;
+		default: *w++ = *s++; break;	/* \" \\ \/ */
+		}
+	}
+	return w;
+}
+
+/* Convert the ISO 8601 time 's' ending at 'end', like nginx writes in
+ * $time_iso8601 ("yyyy-mm-ddThh:mm:ss+hh:mm", with an optional fraction
+ * of second and 'Z' for UTC), in seconds since the epoch. Returns -1 on
+ * format error. */
+time_t vi_json_iso8601(char *s, char *end) {
+	int day, sec, off = 0, h, m;
+	char *p;
+
+	if ((day = vi_w3c_date(s, end)) == -1) return -1;
+	if (end-s < 19 || (s[10] != 'T' && s[10] != ' ')) return -1;
+	if ((sec = vi_w3c_time(s+11, end)) == -1) return -1;
+	p = s+19;
+	if (p < end && *p == '.')
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++);
+	if (end-p >= 5 && (*p == '+' || *p == '-')) {
+		h = vi_w3c_num(p+1, 2);
+		m = vi_w3c_num(p+(p[3] == ':' ? 4 : 3), 2);
+		if (h == -1 || m == -1) return -1;
+		off = (h*3600 + m*60) * (*p == '-' ? -1 : 1);
+	}
+	return (time_t)day*86400 + sec - off;
+}
+
+/* Parse a line of a JSON log, filling the logline structure like
+ * vi_parse_line() does. The members used are remote_addr, remote_user,
+ * request, status, the size in bytes, body_bytes_sent or bytes_sent, and
+ * the time in time_local, time_iso8601, msec (seconds since the epoch)
+ * or time, in any of these forms. On error non-zero is returned. */
+int vi_parse_json(struct vih *vih, struct logline *ll, char *l, int len) {
+	struct vi_delim d;
+	char *start[VI_JSON_FIELDS], *stop[VI_JSON_FIELDS];
+	char *p = l, *end = l+len, *key, *e;
+	int i, field, found = 0;
+	time_t t = 0;
+	long long size = 0;
+
+	while (end > l && (end[-1] == '\n' || end[-1] == '\r'))
+		end--;
+	memset(start, 0, sizeof(start));
+	vi_delim_init(&d, l, end-l);
+	p = vi_json_ws(p, end);
+	if (p == end || *p++ != '{') return 1;
+	while (found != (1 << VI_JSON_FIELDS)-1) {
+		p = vi_json_ws(p, end);
+		if (p == end) return 1;
+		if (*p == '}') break;
+		if (*p == ',') {
+			p++;
+			continue;
+		}
+		/* "key" : value */
+		if (*p != '"') return 1;
+		key = ++p;
+		if ((e = vi_json_string_end(&d, p)) == NULL) return 1;
+		field = vi_json_field(key, e-key);
+		p = e+1;
+		p = vi_json_ws(p, end);
+		if (p == end || *p++ != ':') return 1;
+		p = vi_json_ws(p, end);
+		if (p == end) return 1;
+		if (*p == '"') {
+			if ((e = vi_json_string_end(&d, p+1)) == NULL) return 1;
+			if (field != -1) {
+				start[field] = p+1;
+				stop[field] = memchr(p+1, '\\', e-p-1) ?
+				              vi_json_unescape(p+1, e) : e;
+				found |= 1 << field;
+			}
+			p = e+1;
+		} else {
+			if ((e = vi_json_skip(&d, p, end)) == NULL) return 1;
+			if (field != -1 && e != p &&
+			    !(e-p == 4 && !memcmp(p, "null", 4))) {
+				start[field] = p;
+				stop[field] = e;
+				found |= 1 << field;
+			}
+			p = e;
+		}
+	}
+	/* Nul-terminate the values only now, the characters after them
+	 * were needed to scan the line */
+	for (i = 0; i < VI_JSON_FIELDS; i++)
+		if (start[i]) *stop[i] = '\0';
+
+	/* time */
+	if ((p = start[VI_JSON_TIME]) == NULL) return 1;
+	e = stop[VI_JSON_TIME];
+	if (e-p > 2 && p[2] == '/') {
+		/* dd/Mon/yyyy:hh:mm:ss zone, like %t */
+		if (vi_parse_logdate(vih, p, ll)) return 1;
+		ll->date = p;
+		ll->hour = ll->timezone = "";
+	} else if (e-p > 4 && p[4] == '-') {
+		if ((t = vi_json_iso8601(p, e)) == -1) return 1;
+		vi_epoch_fill(vih, ll, t);
+	} else {
+		if (*p < '0' || *p > '9') return 1;
+		while (*p >= '0' && *p <= '9')
+			t = t*10 + (*p++ - '0');
+		vi_epoch_fill(vih, ll, t);
+	}
+	/* request */
+	ll->verb = NULL;
+	ll->req = start[VI_JSON_REQUEST] ? start[VI_JSON_REQUEST] : "";
+	if ((p = strchr(ll->req, ' ')) != NULL) {
+		ll->verb = ll->req;
+		*p++ = '\0';
+		ll->req = p;
+		/* strip http ver */
+		if ((p = strchr(p, ' ')) != NULL)
+			*p = '\0';
+	}
+	ll->host = start[VI_JSON_HOST] ? start[VI_JSON_HOST] : "";
+	ll->user = start[VI_JSON_USER] && *start[VI_JSON_USER] ?
+	           start[VI_JSON_USER] : "-";
+	// exit if we got an http code with more than 3 digits
+	ll->code = start[VI_JSON_STATUS] ? start[VI_JSON_STATUS] : "";
+	if (strlen(ll->code) > 3) return 1;
+	if (start[VI_JSON_SIZE] != NULL)
+		size = vi_parse_size(start[VI_JSON_SIZE]);
+	ll->size = size;
+	return 0;
+}
+
+/* process the weekday and hour information */
+void vi_process_date_and_hour(struct vih *vih, int weekday, int hour, long long size) {
+	/* Note, the following sanity check is useless in theory. */
+	if (weekday < 0 || weekday > 6 || hour < 0 || hour > 23) return;
+	vih->weekday_hits[weekday]++;
+	vih->weekday_size[weekday] += size;
+	vih->hour_hits[hour]++;
+	vih->hour_size[hour] += size;
+	/* store the combined info. We always compute this information
+	 * even if the report is disabled because it's cheap. */
+	vih->weekdayhour_hits[weekday][hour]++;
+	vih->weekdayhour_size[weekday][hour] += size;
+}
+
+/* process the month and day information */
+void vi_process_month_and_day(struct vih *vih, int month, int day, long long size) {
+	if (month < 0 || month > 11 || day < 0 || day > 30) return;
+	vih->monthday_hits[month][day]++;
+	vih->monthday_size[month][day] += size;
+}
+
+/* Process requests populating the pages and sites hash tables.
+ * Populate also date and month hash tables if requested 
+ * Return non-zero on out of memory. */
+int vi_process_requests(struct vih *vih, char *req, long long size,
+                        time_t time, int day, int month) {
+	char *p, *site = NULL;
+	int res;
+
+	/* Don't count internal links (specified by the user
+	 * using --prefix options) */
+	if (vi_is_internal_link(req))
+		return vi_traffic_incr(&vih->pages, "Internal Link", size, time);
+	res = vi_traffic_incr(&vih->pages, req, size, time);
+	if (res) return 1;
+
+	/* sites */
+	if (Config_process_sites) {
+		if ((p = strchr(req, '/')) != NULL) {
+			site = p+2;
+			/* strip http ver */
+			if ((p = strchr(site, '/')) != NULL) {
+				// this modifies url so we have to restore it below to avoid side effects
+				*p = '\0';
+				res = vi_traffic_incr(&vih->sites, site, size, time);
+				if (res) return 1;
+				// restore url to avoid interfering with functions called after this 
+				*p = '/';
+			}
+		}
+	}
+
+	/* daily hits */
+	if (vi_series_incr(&vih->date, day, 1)) return 1;
+	/* monthly hits */
+	if (Config_process_monthly_hits) {
+		if (vi_series_incr(&vih->month_hits, month, 1)) return 1;
+		if (vi_series_incr(&vih->month_size, month, size)) return 1;
+	}
+	return 0;
+}
+
+/* Process requests populating the types hash table.
+ * Return non-zero on out of memory. */
+int vi_process_types(struct vih *vih, char *url, long long size,
+                     time_t time) {
+	int c;
+	char *dot, *p;
+	char urldecoded[VI_LINE_MAX];
 
 	vi_urldecode(urldecoded, url, VI_LINE_MAX);
 
@@ -1207,78 +2515,63 @@ int vi_process_types(struct vih *vih, char *url, long size) {
 	if (*p) // we found a non digit/alpha so set to null to end file type string
 		*p = '\0';
 	
-    res = vi_counter_incr(&vih->types_hits, dot);
-	if (res == 0) return 1;
-	res = vi_traffic_incr(&vih->types_size, dot, size);
-	if (res == 0) return 1;
-	return 0;
+	return vi_traffic_incr(&vih->types, dot, size, time);
+}
+
+/* Return non-zero if the status code 'code' is 404 */
+int vi_is_404(char *code) {
+	return code[0] == '4' && code[1] == '0' && code[2] == '4' &&
+	       code[3] == '\0';
 }
 
-/* Process log lines for 404 errors report. */
-int vi_process_error404(struct vih *vih, char *l, char *url, int *is404) {
+/* Process the url of a request answered with 404 for the 404 errors
+ * report. Return non-zero on out of memory. */
+int vi_process_error404(struct vih *vih, char *url) {
 	char urldecoded[VI_LINE_MAX];
 
-	if (is404) *is404 = 0;
 	vi_urldecode(urldecoded, url, VI_LINE_MAX);
-	if (strstr(l, " 404 ") && !strstr(l, " 200 ")) {
-		if (is404) *is404 = 1;
-		return !vi_counter_incr(&vih->error404, urldecoded);
-	}
-	return 0;
+	return !vi_counter_incr(&vih->error404, urldecoded);
 }
 
 /* Process codes populating the relative hash table.
  * Return non-zero on out of memory. */
-int vi_process_codes(struct vih *vih, char *code, long size) {
-	int res;
+int vi_process_codes(struct vih *vih, char *code, long long size,
+                     time_t time) {
+	return vi_traffic_incr(&vih->codes, code, size, time);
+}
 
-	res = vi_traffic_incr(&vih->codes_size, code, size);
-	if (res == 0) return 1;
-	res = vi_counter_incr(&vih->codes_hits, code);
-	if (res == 0) return 1;
-	return 0;
+/* Process the cache result codes of squid populating the relative
+ * hash table. Return non-zero on out of memory. */
+int vi_process_cache(struct vih *vih, char *result, long long size,
+                     time_t time) {
+	return vi_traffic_incr(&vih->results, result, size, time);
 }
 
 /* Process verbs populating the relative hash table.
  * Return non-zero on out of memory. */
-int vi_process_verbs(struct vih *vih, char *verb, long size) {
-	int res;
-
-	res = vi_traffic_incr(&vih->verbs_size, verb, size);
-	if (res == 0) return 1;
-	res = vi_counter_incr(&vih->verbs_hits, verb);
-	if (res == 0) return 1;
-	return 0;
+int vi_process_verbs(struct vih *vih, char *verb, long long size,
+                     time_t time) {
+	return vi_traffic_incr(&vih->verbs, verb, size, time);
 }
 
 /* Process users populating the relative hash table.
  * Return non-zero on out of memory. */
-int vi_process_users(struct vih *vih, char *user, long size) {
-	int res;
-
-	res = vi_traffic_incr(&vih->users_size, user, size);
-	if (res == 0) return 1;
-	res = vi_counter_incr(&vih->users_hits, user);
-	if (res == 0) return 1;
-	return 0;
+int vi_process_users(struct vih *vih, char *user, long long size,
+                     time_t time) {
+	return vi_traffic_incr(&vih->users, user, size, time);
 }
 
 /* Process hosts populating the relative hash table.
  * Return non-zero on out of memory. */
-int vi_process_hosts(struct vih *vih, char *host, long size) {
-	int res;
-
-	res = vi_traffic_incr(&vih->hosts_size, host, size);
-	if (res == 0) return 1;
-	res = vi_counter_incr(&vih->hosts_hits, host);
-	if (res == 0) return 1;
-	return 0;
+int vi_process_hosts(struct vih *vih, char *host, long long size,
+                     time_t time) {
+	return vi_traffic_incr(&vih->hosts, host, size, time);
 }
 
 /* Match the list of keywords 't' against the string 's', and if
  * a match is found increment the matching keyword in the hashtable.
  * Return zero on success, non-zero on out of memory . */
-int vi_counter_incr_matchtable(struct hashtable *ht, char *s, char **t) {
+int vi_counter_incr_matchtable(struct fht *ht, char *s, char **t) {
 	while(*t) {
 		int res;
 		if ((*t)[0] == '\0' || strstr(s, *t) != NULL) {
@@ -1333,9 +2626,9 @@ char *strrev(char *str) {
 	return str;
 }
 
-/* Match a log line against --grep and --exclude patterns to check
- * if the line must be processed or not. */
-int vi_match_line(char *line) {
+/* Match a log line of length 'len' against --grep and --exclude patterns
+ * to check if the line must be processed or not. */
+int vi_match_line(char *line, int len) {
 	int i;
 
 	for (i = 0; i < Config_grep_pattern_num; i++) {
@@ -1348,7 +2641,9 @@ int vi_match_line(char *line) {
 			nocase = 0;
 			pattern += 3;
 		}
-		if (vi_match(Config_grep_pattern[i].pattern, line, nocase)) {
+		if (vi_match_len(Config_grep_pattern[i].pattern,
+		                 strlen(Config_grep_pattern[i].pattern),
+		                 line, len, nocase)) {
 			if (Config_grep_pattern[i].type == VI_PATTERNTYPE_EXCLUDE)
 				return 0;
 		} else {
@@ -1359,54 +2654,81 @@ int vi_match_line(char *line) {
 	return 1;
 }
 
-/* Process a line of log. Returns non-zero on error. */
-int vi_process_line(struct vih *vih, char *l) {
+/* Count a line longer than VI_LINE_MAX-1 bytes as an invalid entry. The
+ * rule is the same however the line is read (mapped file, stdio,
+ * decompressor, stream or follow mode): longer lines are never truncated
+ * or split, their bytes after the limit are just dropped. */
+void vi_long_line(struct vih *vih) {
+	vih->processed++;
+	vih->invalid++;
+	if (Config_debug)
+		fprintf(stderr, "Invalid line: longer than %d bytes\n",
+		        VI_LINE_MAX-1);
+}
+
+/* Process a line of log. 'l' is a nul-terminated line of 'len' bytes
+ * that the parser is allowed to modify in place.
+ * Returns non-zero on error. */
+int vi_process_line(struct vih *vih, char *l, int len) {
 	struct logline ll;
 	char origline[VI_LINE_MAX];
 
+	if (len >= VI_LINE_MAX) {
+		vi_long_line(vih);
+		return 0;
+	}
+	/* Directives of W3C extended logs change the layout of the lines
+	 * that follow, they are not log entries. */
+	if (*l == '#' && Parser == vi_parse_w3c) {
+		vi_w3c_directive(&vih->w3c, l, l+len);
+		return 0;
+	}
 	/* Test the line against --grep --exclude patterns before
 	 * to process it. */
 	if (Config_grep_pattern_num) {
-		if (vi_match_line(l) == 0)
+		if (vi_match_line(l, len) == 0)
 			return 0; /* No match? skip. */
 	}
 
 	vih->processed++;
-	/* Take a copy of the original log line before to
-	 * copy it. Will be useful for some processing.
-	 * Do it only if required in order to speedup. */
-	if (Config_process_error404 || Config_debug)
-		vi_strlcpy(origline, l, VI_LINE_MAX);
+	/* The parser splits the line in place, so with --debug a copy of
+	 * the original line is taken to show it if it is invalid. */
+	if (Config_debug)
+		memcpy(origline, l, len+1);
 	/* Split the line and run all the selected processing. */
-	if (vi_parse_line(&ll, l) == 0) {
-		int seen = 0, is404;
+	ll.result = NULL;	/* only squid logs have it */
+	if (Parser(vih, &ll, l, len) == 0) {
+		int seen = 0, is404 = vi_is_404(ll.code);
 
 		/* We process 404 errors first, in order to skip
 		 * all the other reports if --ignore-404 option is active. */
-		if (Config_process_error404 &&
-		        vi_process_error404(vih, origline, ll.req, &is404))
+		if (Config_process_error404 && is404 &&
+		        vi_process_error404(vih, ll.req))
 			goto oom;
 		/* 404 error AND --ignore-404? Stop processing of this line. */
 		if (Config_ignore_404 && is404)
 			return 0;
 
 		/* The following are processed for every log line */
-		if (vi_process_requests(vih, ll.req, ll.size, ll.date)) goto oom;
+		if (vi_process_requests(vih, ll.req, ll.size, ll.time, ll.day,
+		                        ll.month)) goto oom;
 
 		vi_process_date_and_hour(vih, (ll.tm.tm_wday+6)%7,
 		                         ll.tm.tm_hour, ll.size);
 		vi_process_month_and_day(vih, ll.tm.tm_mon, ll.tm.tm_mday-1, ll.size);
 
 		if (Config_process_users &&
-		        vi_process_users(vih, ll.user, ll.size)) goto oom;
+		        vi_process_users(vih, ll.user, ll.size, ll.time)) goto oom;
 		if (Config_process_types &&
-		        vi_process_types(vih, ll.req, ll.size)) goto oom;
+		        vi_process_types(vih, ll.req, ll.size, ll.time)) goto oom;
 		if (Config_process_codes &&
-		        vi_process_codes(vih, ll.code, ll.size)) goto oom;
-		if (Config_process_verbs &&
-		        vi_process_verbs(vih, ll.verb, ll.size)) goto oom;
+		        vi_process_codes(vih, ll.code, ll.size, ll.time)) goto oom;
+		if (Config_process_verbs && ll.verb != NULL &&
+		        vi_process_verbs(vih, ll.verb, ll.size, ll.time)) goto oom;
 		if (Config_process_hosts &&
-		        vi_process_hosts(vih, ll.host, ll.size)) goto oom;
+		        vi_process_hosts(vih, ll.host, ll.size, ll.time)) goto oom;
+		if (Config_process_cache && ll.result != NULL &&
+		        vi_process_cache(vih, ll.result, ll.size, ll.time)) goto oom;
 
 		/* The following are processed only for new visits */
 		if (seen) return 0;
@@ -1423,39 +2745,1580 @@ oom:
 	return 1;
 }
 
-/* Process the specified log file. Returns zero on success.
- * On error non zero is returned and an error is set in the handle. */
-int vi_scan(struct vih *vih, char *filename) {
+/* Process all the lines contained in the memory region 'buf' of 'len'
+ * bytes. Lines are nul-terminated in place (the newline is replaced),
+ * so the parser works directly on the buffer without copies. A last
+ * line without the trailing newline is copied in a local buffer as
+ * there may be no room to nul-terminate it.
+ * Returns zero on success, non-zero on error. */
+int vi_scan_buffer(struct vih *vih, char *buf, size_t len) {
+	char *p = buf, *end = buf+len;
+
+	while (p < end) {
+		char *nl = memchr(p, '\n', end-p);
+
+		if (nl == NULL) {
+			char last[VI_LINE_MAX];
+			size_t l = end-p;
+
+			if (l >= VI_LINE_MAX) {
+				vi_long_line(vih);
+				return 0;
+			}
+			memcpy(last, p, l);
+			last[l] = '\0';
+			return vi_process_line(vih, last, l);
+		}
+		*nl = '\0';
+		if (vi_process_line(vih, p, nl-p))
+			return 1;
+		p = nl+1;
+	}
+	return 0;
+}
+
+/* Return the compression format of the specified file looking at its
+ * first bytes. VI_COMP_NONE is returned for plain files, and for files
+ * that can't be opened, so that the error is reported later. */
+int vi_file_compression(char *filename) {
+	unsigned char magic[VI_COMP_MAGIC_LEN];
+	size_t n;
 	FILE *fp;
-	char buf[VI_LINE_MAX];
-	int use_stdin = 0;
 
-	if (filename[0] == '-' && filename[1] == '\0') {
-		/* If we are in stream mode, just return. Stdin
-		 * is implicit in this mode and will be read
-		 * after all the other files are processed. */
-		if (Config_stream_mode) return 0;
-		fp = stdin;
-		use_stdin = 1;
+	if ((fp = fopen(filename, "rb")) == NULL) return VI_COMP_NONE;
+	n = fread(magic, 1, VI_COMP_MAGIC_LEN, fp);
+	fclose(fp);
+	return vi_decomp_type(magic, n);
+}
+
+/* Load the seek index of the compressed file 'filename' from its sidecar
+ * file, if it is still valid, otherwise 'idx' is initialized empty so
+ * that it can be built. Returns 0 if a valid index was loaded. */
+int vi_index_load(struct vi_decomp_index *idx, char *filename, int type) {
+	char *sidecar;
+	struct stat sb;
+	int retval;
+
+	if (stat(filename, &sb) == -1) {
+		vi_decomp_index_init(idx, type, 0, 0, VI_INDEX_SPAN);
+		idx->failed = 1;
+		return -1;
+	}
+	vi_decomp_index_init(idx, type, sb.st_size, sb.st_mtime, VI_INDEX_SPAN);
+	if ((sidecar = malloc(strlen(filename)+strlen(VI_INDEX_SUFFIX)+1)) == NULL)
+		return -1;
+	sprintf(sidecar, "%s%s", filename, VI_INDEX_SUFFIX);
+	retval = vi_decomp_index_load(idx, sidecar);
+	free(sidecar);
+	return retval;
+}
+
+/* Save the seek index of the compressed file 'filename' in its sidecar
+ * file. Failures are not fatal: the index is just a cache. */
+void vi_index_save(struct vi_decomp_index *idx, char *filename) {
+	char *sidecar;
+
+	if ((sidecar = malloc(strlen(filename)+strlen(VI_INDEX_SUFFIX)+1)) == NULL)
+		return;
+	sprintf(sidecar, "%s%s", filename, VI_INDEX_SUFFIX);
+	if (vi_decomp_index_save(idx, sidecar) == -1 && Config_debug)
+		fprintf(stderr, "Unable to save the index '%s'\n", sidecar);
+	free(sidecar);
+}
+
+/* Process the compressed log file 'filename'. The file is decompressed
+ * block by block in a large buffer, and all the complete lines of the
+ * buffer are processed in place, like for a mapped file. The last
+ * partial line is moved at the start of the buffer and completed with
+ * the next block.
+ *
+ * If 'idx' is NULL the whole file is processed, building its seek index
+ * when --index is used and the sidecar file is missing or stale.
+ * Otherwise only the lines starting in the range of the access point
+ * 'point' of the index are processed: the first line starting after its
+ * uncompressed offset, up to the line containing the offset of the next
+ * point. So every line belongs to exactly one range.
+ *
+ * The first 'from' bytes of the uncompressed data are skipped: they were
+ * already processed by a previous run, see --state. 'from' must be the
+ * start of a line, and zero if 'idx' is used.
+ * Returns zero on success, non-zero on error (set in the handle). */
+int vi_scan_compressed(struct vih *vih, char *filename, int type,
+                       struct vi_decomp_index *idx, int point,
+                       long long from) {
+	struct vi_decomp d;
+	struct vi_decomp_index build;
+	FILE *fp;
+	char *buf;
+	size_t used = 0;
+	long long base = 0, stop = -1;
+	long n = 0;
+	int retval = 0, skip = 0, building = 0, finished = 0;
+	double start = vi_clock();
+
+	if ((fp = fopen(filename, "rb")) == NULL) {
+		vi_set_error(vih, "Unable to open '%s': '%s'", filename, strerror(errno));
+		return 1;
+	}
+	if ((buf = malloc(VI_DECOMP_BUFLEN)) == NULL) {
+		fclose(fp);
+		vi_set_error(vih, "Out of memory decompressing '%s'", filename);
+		return 1;
+	}
+	if (idx) {
+		base = idx->point[point].out;
+		skip = point != 0;
+		if (point+1 < idx->points)
+			stop = idx->point[point+1].out;
+		retval = vi_decomp_open_at(&d, fp, idx, point);
 	} else {
-		if ((fp = fopen(filename, "r")) == NULL) {
-			vi_set_error(vih, "Unable to open '%s': '%s'", filename, strerror(errno));
-			return 1;
+		retval = vi_decomp_open(&d, fp, type);
+		if (retval == 0 && Config_index &&
+		    vi_index_load(&build, filename, type) == -1 &&
+		    !build.failed) {
+			d.index = &build;
+			building = 1;
+		} else if (retval == 0 && Config_index) {
+			vi_decomp_index_free(&build);
+		}
+	}
+	if (retval == -1) {
+		vi_set_error(vih, "Decompressing '%s' (%s): %s", filename,
+		             vi_decomp_name(type), d.error);
+		free(buf);
+		fclose(fp);
+		return 1;
+	}
+	retval = 0;
+	while (!finished) {
+		size_t len, want = VI_DECOMP_BUFLEN-used;
+
+		/* Don't decompress much more than the end of the range */
+		if (stop != -1) {
+			long long left = stop+VI_LINE_MAX-(base+(long long)used);
+
+			if (left < VI_LINE_MAX) left = VI_LINE_MAX;
+			if (left < (long long)want) want = left;
+		}
+		if ((n = vi_decomp_read(&d, buf+used, want)) <= 0) break;
+		used += n;
+		if (base < from) {
+			size_t drop = from-base < (long long)used ?
+			              (size_t)(from-base) : used;
+
+			memmove(buf, buf+drop, used-drop);
+			used -= drop;
+			base += drop;
+			if (used == 0) continue;
+		}
+		if (skip) {
+			/* Skip the line started in the previous range */
+			char *nl = memchr(buf, '\n', used);
+
+			if (nl == NULL) {
+				base += used;
+				used = 0;
+				continue;
+			}
+			len = nl-buf+1;
+			if (stop != -1 && base+(long long)len-1 >= stop) {
+				used = 0;
+				break; /* no line starts in this range */
+			}
+			memmove(buf, buf+len, used-len);
+			used -= len;
+			base += len;
+			skip = 0;
+		}
+		/* Search the end of the last complete line */
+		for (len = used; len > 0 && buf[len-1] != '\n'; len--);
+		if (len == 0) {
+			/* No newline at all: wait for more data unless the
+			 * buffer is full. Such a line is too long, it is
+			 * counted and the rest of it skipped. */
+			if (used < VI_DECOMP_BUFLEN) continue;
+			vi_long_line(vih);
+			base += used;
+			used = 0;
+			skip = 1;
+			continue;
+		}
+		if (stop != -1 && base+(long long)len > stop) {
+			/* The range ends in this block, after the line
+			 * containing the offset of the next point. */
+			char *nl = memchr(buf+(stop-base), '\n', len-(stop-base));
+
+			if (nl) len = nl-buf+1;
+			finished = 1;
+		}
+		if (vi_scan_buffer(vih, buf, len)) {
+			retval = 1;
+			break;
+		}
+		memmove(buf, buf+len, used-len);
+		used -= len;
+		base += len;
+	}
+	if (!finished && n == -1) {
+		vi_set_error(vih, "Decompressing '%s' (%s): %s", filename,
+		             vi_decomp_name(type), d.error);
+		retval = 1;
+	} else if (retval == 0 && !finished && !skip && used) {
+		retval = vi_scan_buffer(vih, buf, used);
+	}
+	if (building) {
+		if (retval == 0 && d.done)
+			vi_index_save(&build, filename);
+		vi_decomp_index_free(&build);
+	}
+	vih->compressed_bytes += d.inbytes;
+	vih->uncompressed_bytes += d.outbytes;
+	vih->decomp_time += vi_clock() - start;
+	vi_decomp_close(&d);
+	free(buf);
+	fclose(fp);
+	return retval;
+}
+
+#ifdef VI_HAVE_MMAP
+/* Map the specified log file in memory, storing the address and the
+ * length of the mapping in '*map' and '*len'. Empty files are valid and
+ * result in a NULL map of zero bytes.
+ * Returns 0 on success, or -1 if the file can't be mapped (can't be
+ * opened, not a regular file, mmap failure, ...) so that the caller
+ * can fall back to stdio. */
+int vi_map_file(char *filename, char **map, size_t *len) {
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) == -1) return -1;
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) ||
+	    (off_t)(size_t)sb.st_size != sb.st_size) {
+		close(fd);
+		return -1;
+	}
+	*map = NULL;
+	*len = sb.st_size;
+	if (sb.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	/* The mapping is private and writable: lines are nul-terminated
+	 * in place without touching the file. */
+	*map = mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (*map == MAP_FAILED) return -1;
+	madvise(*map, sb.st_size, MADV_SEQUENTIAL);
+	return 0;
+}
+
+/* Process the specified log file mapping it in memory.
+ * Returns 0 on success, 1 on processing error (the error is set in the
+ * handle), or -1 if the file can't be mapped. */
+int vi_scan_mmap(struct vih *vih, char *filename) {
+	char *map;
+	size_t len;
+	int retval;
+
+	if (vi_map_file(filename, &map, &len) == -1) return -1;
+	if (len == 0) return 0;
+	retval = vi_scan_buffer(vih, map, len);
+	munmap(map, len);
+	return retval;
+}
+#endif
+
+/* Read a line of 'fp' in 'buf', of VI_LINE_MAX bytes, like fgets().
+ * The rest of a longer line is read and dropped, and '*toolong' is set
+ * to count it as an invalid entry. Returns NULL at the end of file. */
+char *vi_fgets(char *buf, FILE *fp, int *toolong) {
+	size_t len;
+	int c;
+
+	*toolong = 0;
+	if (fgets(buf, VI_LINE_MAX, fp) == NULL) return NULL;
+	len = strlen(buf);
+	if (len < VI_LINE_MAX-1 || buf[len-1] == '\n') return buf;
+	/* Full buffer, still fine if the line ends just here */
+	if ((c = getc(fp)) == EOF || c == '\n') return buf;
+	*toolong = 1;
+	while ((c = getc(fp)) != EOF && c != '\n');
+	return buf;
+}
+
+/* Process the specified log file. Returns zero on success.
+ * On error non zero is returned and an error is set in the handle.
+ * Regular files are memory mapped when possible, stdio is used
+ * for the standard input, pipes and as a fallback. */
+int vi_scan(struct vih *vih, char *filename) {
+	FILE *fp;
+	char buf[VI_LINE_MAX];
+	int use_stdin = 0, toolong;
+
+	if (filename[0] == '-' && filename[1] == '\0') {
+		/* If we are in stream mode, just return. Stdin
+		 * is implicit in this mode and will be read
+		 * after all the other files are processed. */
+		if (Config_stream_mode) return 0;
+		fp = stdin;
+		use_stdin = 1;
+	} else {
+		int retval, type = vi_file_compression(filename);
+
+		if (type != VI_COMP_NONE) {
+			retval = vi_scan_compressed(vih, filename, type, NULL, 0, 0);
+			vih->endt = time(NULL);
+			return retval;
+		}
+#ifdef VI_HAVE_MMAP
+		retval = vi_scan_mmap(vih, filename);
+
+		if (retval != -1) {
+			if (retval)
+				fprintf(stderr, "%s: %s\n", filename, vi_get_error(vih));
+			vih->endt = time(NULL);
+			return retval;
+		}
+#endif
+		if ((fp = fopen(filename, "r")) == NULL) {
+			vi_set_error(vih, "Unable to open '%s': '%s'", filename, strerror(errno));
+			return 1;
+		}
+	}
+	while (vi_fgets(buf, fp, &toolong) != NULL) {
+		if (toolong) {
+			vi_long_line(vih);
+			continue;
+		}
+		if (vi_process_line(vih, buf, strlen(buf))) {
+			fclose(fp);
+			fprintf(stderr, "%s: %s\n", filename, vi_get_error(vih));
+			return 1;
+		}
+	}
+	if (!use_stdin)
+		fclose(fp);
+	vih->endt = time(NULL);
+	return 0;
+}
+
+/* --------------------------------- snapshots ------------------------------ */
+/* A snapshot is a compact binary dump of all the statistics of a handle,
+ * used to save the results of an analysis (--save), to load them again
+ * without to process the logs (--load), and as part of the state file of
+ * the incremental runs (--state).
+ *
+ * All the integers are stored as LEB128 varints, so the format does not
+ * depend on the byte order and small counters take a single byte:
+ *
+ * "VISN" version length processed invalid blacklisted <arrays>
+ * then for every hashtable (see vi_get_tables()) the number of entries
+ * followed by keylen key hits bytes first last for every entry, where
+ * first and last are the zigzag encoded times of the first and of the
+ * last request of the key, then for every series
+ * of counters (see vi_get_series()) the number of counters, the index
+ * of the first one (zigzag encoded, it may be negative) and the counters.
+ * Sizes are in bytes. Snapshots of other versions are rejected.
+ *
+ * 'length' is the number of bytes after it, used to detect truncated
+ * files. The whole snapshot is encoded in memory and written with a
+ * single write, and it is decoded from a single mapping of the file. */
+#define VI_SNAPSHOT_MAGIC "VISN"
+#define VI_SNAPSHOT_VERSION 1
+
+/* Growing memory buffer, snapshots are encoded into it */
+struct vi_buf {
+	unsigned char *p;
+	size_t len;
+	size_t alloc;
+	int oom;	/* set if some append failed */
+};
+
+/* Bounded reader of an encoded snapshot */
+struct vi_reader {
+	unsigned char *p;
+	unsigned char *end;
+	int err;	/* set on truncated or invalid data */
+};
+
+/* Append 'len' bytes at 'p' to the buffer */
+void vi_buf_put(struct vi_buf *b, void *p, size_t len) {
+	if (b->oom) return;
+	if (b->len+len > b->alloc) {
+		size_t alloc = b->alloc ? b->alloc : 65536;
+		unsigned char *n;
+
+		while (alloc < b->len+len) alloc *= 2;
+		if ((n = realloc(b->p, alloc)) == NULL) {
+			b->oom = 1;
+			return;
+		}
+		b->p = n;
+		b->alloc = alloc;
+	}
+	memcpy(b->p+b->len, p, len);
+	b->len += len;
+}
+
+/* Append the integer 'v' as a varint */
+void vi_buf_varint(struct vi_buf *b, unsigned long long v) {
+	unsigned char tmp[10];
+	int n = 0;
+
+	while (v >= 0x80) {
+		tmp[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	tmp[n++] = v;
+	vi_buf_put(b, tmp, n);
+}
+
+unsigned long long vi_read_varint(struct vi_reader *r) {
+	unsigned long long v = 0;
+	int shift = 0;
+
+	while (r->p < r->end && shift < 64) {
+		unsigned char c = *r->p++;
+
+		v |= (unsigned long long)(c & 0x7f) << shift;
+		if (!(c & 0x80)) return v;
+		shift += 7;
+	}
+	r->err = 1;
+	return 0;
+}
+
+/* Return a pointer to the next 'len' bytes, NULL if there are not */
+unsigned char *vi_read_bytes(struct vi_reader *r, size_t len) {
+	unsigned char *p = r->p;
+
+	if ((size_t)(r->end - r->p) < len) {
+		r->err = 1;
+		return NULL;
+	}
+	r->p += len;
+	return p;
+}
+
+/* Encode the integer array 'a' of 'n' elements */
+void vi_buf_array(struct vi_buf *b, int *a, int n) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		vi_buf_varint(b, (unsigned int) a[i]);
+}
+
+/* Encode the 64 bit array 'a' of 'n' elements */
+void vi_buf_array64(struct vi_buf *b, long long *a, int n) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		vi_buf_varint(b, (unsigned long long) a[i]);
+}
+
+/* Append the signed integer 'v' as a zigzag encoded varint */
+void vi_buf_svarint(struct vi_buf *b, long long v) {
+	vi_buf_varint(b, ((unsigned long long)v << 1) ^ (v < 0 ? ~0ULL : 0));
+}
+
+long long vi_read_svarint(struct vi_reader *r) {
+	unsigned long long v = vi_read_varint(r);
+
+	return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+/* Decode 'n' integers adding them to the array 'a' */
+void vi_read_array(struct vi_reader *r, int *a, int n) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		a[i] += (unsigned int) vi_read_varint(r);
+}
+
+/* Decode 'n' integers adding them to the 64 bit array 'a' */
+void vi_read_array64(struct vi_reader *r, long long *a, int n) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		a[i] += (long long) vi_read_varint(r);
+}
+
+/* Append the snapshot of the handle to the buffer. Returns 0 on success,
+ * non-zero on out of memory. */
+int vi_snapshot_encode(struct vih *vih, struct vi_buf *b) {
+	struct fht *tables[VI_TABLES];
+	struct vi_series *series[VI_SERIES];
+	struct vi_buf body = {NULL, 0, 0, 0};
+	unsigned int i, j;
+
+	vi_buf_varint(&body, vih->processed);
+	vi_buf_varint(&body, vih->invalid);
+	vi_buf_varint(&body, vih->blacklisted);
+	vi_buf_array(&body, vih->hour_hits, 24);
+	vi_buf_array64(&body, vih->hour_size, 24);
+	vi_buf_array(&body, vih->weekday_hits, 7);
+	vi_buf_array64(&body, vih->weekday_size, 7);
+	vi_buf_array(&body, &vih->weekdayhour_hits[0][0], 7*24);
+	vi_buf_array64(&body, &vih->weekdayhour_size[0][0], 7*24);
+	vi_buf_array(&body, &vih->monthday_hits[0][0], 12*31);
+	vi_buf_array64(&body, &vih->monthday_size[0][0], 12*31);
+	vi_get_tables(vih, tables);
+	for (i = 0; i < VI_TABLES; i++) {
+		struct fht *t = tables[i];
+
+		vi_buf_varint(&body, fht_used(t));
+		for (j = 0; j < fht_size(t); j++) {
+			struct fht_entry *e = fht_entry(t, j);
+
+			if (!fht_busy(t, j)) continue;
+			vi_buf_varint(&body, e->len);
+			vi_buf_put(&body, e->key, e->len);
+			vi_buf_varint(&body, (unsigned long long) e->hits);
+			vi_buf_varint(&body, (unsigned long long) e->bytes);
+			vi_buf_svarint(&body, e->first);
+			vi_buf_svarint(&body, e->last);
+		}
+	}
+	vi_get_series(vih, series);
+	for (i = 0; i < VI_SERIES; i++) {
+		struct vi_series *sr = series[i];
+		int lo = 0, hi = -1;
+
+		/* Only the range of non-zero counters is stored */
+		for (j = 0; j < (unsigned int) sr->len; j++) {
+			if (!sr->counter[j]) continue;
+			if (hi == -1) lo = j;
+			hi = j;
+		}
+		vi_buf_varint(&body, hi-lo+1);
+		vi_buf_svarint(&body, sr->first+lo);
+		for (j = lo; (int) j <= hi; j++)
+			vi_buf_varint(&body, (unsigned long long) sr->counter[j]);
+	}
+	vi_buf_put(b, VI_SNAPSHOT_MAGIC, 4);
+	vi_buf_varint(b, VI_SNAPSHOT_VERSION);
+	vi_buf_varint(b, body.len);
+	if (body.len) vi_buf_put(b, body.p, body.len);
+	free(body.p);
+	return b->oom || body.oom;
+}
+
+/* Decode a snapshot from the reader, adding its statistics to the handle:
+ * a snapshot can be loaded in a handle that already contains data.
+ * Returns 0 on success, non-zero on error (set in the handle). */
+int vi_snapshot_decode(struct vih *vih, struct vi_reader *r) {
+	struct fht *tables[VI_TABLES];
+	struct vi_series *series[VI_SERIES];
+	unsigned char *magic;
+	unsigned long long version, len;
+	struct vi_reader body;
+	unsigned int i;
+
+	magic = vi_read_bytes(r, 4);
+	if (magic == NULL || memcmp(magic, VI_SNAPSHOT_MAGIC, 4)) {
+		vi_set_error(vih, "Not a visited snapshot");
+		return 1;
+	}
+	version = vi_read_varint(r);
+	if (version != VI_SNAPSHOT_VERSION) {
+		vi_set_error(vih, "Unsupported snapshot version %llu", version);
+		return 1;
+	}
+	len = vi_read_varint(r);
+	if ((body.p = vi_read_bytes(r, len)) == NULL) goto corrupted;
+	body.end = body.p+len;
+	body.err = 0;
+	vih->processed += vi_read_varint(&body);
+	vih->invalid += vi_read_varint(&body);
+	vih->blacklisted += vi_read_varint(&body);
+	vi_read_array(&body, vih->hour_hits, 24);
+	vi_read_array64(&body, vih->hour_size, 24);
+	vi_read_array(&body, vih->weekday_hits, 7);
+	vi_read_array64(&body, vih->weekday_size, 7);
+	vi_read_array(&body, &vih->weekdayhour_hits[0][0], 7*24);
+	vi_read_array64(&body, &vih->weekdayhour_size[0][0], 7*24);
+	vi_read_array(&body, &vih->monthday_hits[0][0], 12*31);
+	vi_read_array64(&body, &vih->monthday_size[0][0], 12*31);
+	vi_get_tables(vih, tables);
+	vi_get_series(vih, series);
+	for (i = 0; i < VI_TABLES && !body.err; i++) {
+		struct fht *t = tables[i];
+		unsigned long long entries = vi_read_varint(&body), j;
+
+		/* Every entry takes at least five bytes */
+		if (entries > (unsigned long long)(body.end-body.p)/5)
+			goto corrupted;
+		if (fht_expand(t, fht_used(t)+entries))
+			goto oom;
+		for (j = 0; j < entries && !body.err; j++) {
+			unsigned long long keylen = vi_read_varint(&body);
+			unsigned char *p = vi_read_bytes(&body, keylen);
+			long long hits = vi_read_varint(&body);
+			long long size = vi_read_varint(&body);
+			long long first = vi_read_svarint(&body);
+			long long last = vi_read_svarint(&body);
+			struct fht_entry *e;
+			int added;
+
+			if (body.err) break;
+			/* Keys already there have their counters summed */
+			if ((e = fht_insert(t, (char*) p, keylen, &added)) == NULL)
+				goto oom;
+			e->hits += hits;
+			e->bytes += size;
+			vi_entry_seen(e, first, last);
+		}
+	}
+	for (i = 0; i < VI_SERIES && !body.err; i++) {
+		unsigned long long n = vi_read_varint(&body), j;
+		long long first = vi_read_svarint(&body);
+
+		if (n > (unsigned long long)(body.end-body.p) ||
+		    first < -VI_SERIES_MAX || first+(long long)n > VI_SERIES_MAX)
+			goto corrupted;
+		for (j = 0; j < n && !body.err; j++) {
+			long long val = vi_read_varint(&body);
+
+			if (val && vi_series_incr(series[i], first+j, val))
+				goto oom;
+		}
+	}
+	if (body.err || body.p != body.end) goto corrupted;
+	return 0;
+
+corrupted:
+	vi_set_error(vih, "Truncated or corrupted snapshot");
+	return 1;
+oom:
+	vi_set_error(vih, "Out of memory loading the snapshot");
+	return 1;
+}
+
+/* Write the 'len' bytes at 'p' to the file 'filename', atomically: the
+ * data is written to a temporary file renamed at the end.
+ * Returns 0 on success, non-zero on error (set in the handle). */
+int vi_write_file(struct vih *vih, char *filename, void *p, size_t len) {
+	char *tmp;
+	FILE *fp;
+	int err;
+
+	if ((tmp = malloc(strlen(filename)+5)) == NULL) {
+		vi_set_error(vih, "Out of memory");
+		return 1;
+	}
+	sprintf(tmp, "%s.tmp", filename);
+	if ((fp = fopen(tmp, "wb")) == NULL) {
+		vi_set_error(vih, "Unable to create '%s': '%s'", tmp, strerror(errno));
+		free(tmp);
+		return 1;
+	}
+	err = fwrite(p, 1, len, fp) != len;
+	err |= fclose(fp) != 0;
+	if (err || rename(tmp, filename) == -1) {
+		vi_set_error(vih, "Error writing '%s': '%s'", filename, strerror(errno));
+		remove(tmp);
+		free(tmp);
+		return 1;
+	}
+	free(tmp);
+	return 0;
+}
+
+/* Read the whole file 'filename', mapping it in memory when possible
+ * ('*mapped' is set accordingly). The data must be released with
+ * vi_release_file().
+ * Returns 0 on success, non-zero on error (set in the handle). */
+int vi_read_file(struct vih *vih, char *filename, char **p, size_t *len,
+                 int *mapped) {
+	FILE *fp;
+	long size;
+
+	*mapped = 0;
+#ifdef VI_HAVE_MMAP
+	if (vi_map_file(filename, p, len) == 0) {
+		*mapped = 1;
+		return 0;
+	}
+#endif
+	if ((fp = fopen(filename, "rb")) == NULL) {
+		vi_set_error(vih, "Unable to open '%s': '%s'", filename, strerror(errno));
+		return 1;
+	}
+	if (fseek(fp, 0, SEEK_END) == -1 || (size = ftell(fp)) == -1 ||
+	    fseek(fp, 0, SEEK_SET) == -1 || (*p = malloc(size+1)) == NULL ||
+	    fread(*p, 1, size, fp) != (size_t)size) {
+		vi_set_error(vih, "Error reading '%s'", filename);
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+	*len = size;
+	return 0;
+}
+
+void vi_release_file(char *p, size_t len, int mapped) {
+#ifdef VI_HAVE_MMAP
+	if (mapped) {
+		if (p) munmap(p, len);
+		return;
+	}
+#endif
+	(void) len;
+	(void) mapped;
+	free(p);
+}
+
+/* Save the snapshot of the handle in the file 'filename'.
+ * Returns 0 on success, non-zero on error (set in the handle). */
+int vi_snapshot_save(struct vih *vih, char *filename) {
+	struct vi_buf b = {NULL, 0, 0, 0};
+	int retval;
+
+	if (vi_snapshot_encode(vih, &b)) {
+		vi_set_error(vih, "Out of memory saving the snapshot");
+		free(b.p);
+		return 1;
+	}
+	retval = vi_write_file(vih, filename, b.p, b.len);
+	free(b.p);
+	return retval;
+}
+
+/* Load the snapshot saved in 'filename' adding it to the handle.
+ * Returns 0 on success, non-zero on error (set in the handle). */
+int vi_snapshot_load(struct vih *vih, char *filename) {
+	struct vi_reader r;
+	char *p = NULL;
+	size_t len = 0;
+	int retval, mapped;
+
+	if (vi_read_file(vih, filename, &p, &len, &mapped)) return 1;
+	r.p = (unsigned char*) p;
+	r.end = r.p+len;
+	r.err = 0;
+	retval = vi_snapshot_decode(vih, &r);
+	if (retval == 0 && r.p != r.end) {
+		vi_set_error(vih, "Trailing garbage after the snapshot");
+		retval = 1;
+	}
+	vi_release_file(p, len, mapped);
+	return retval;
+}
+
+/* ------------------------------ snapshots merge --------------------------- */
+/* With --merge the arguments are snapshots saved with --save, for example
+ * on different servers, that are summed in a single report. Every
+ * snapshot is loaded in its own handle, then the handles are merged in
+ * pairs as a tree: 0+1, 2+3, ... then 0+2, 4+6, ... so every round halves
+ * the handles and the merges of a round run in parallel. */
+struct vi_merge_ctx {
+	struct vih **h;
+	char **filenames;
+	int n;
+	int stride;		/* 0 while loading, then the merge distance */
+	int next;		/* next job to take */
+	volatile int failed;
+#ifdef VI_HAVE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+/* Run the jobs of the current round until there are no more: load the
+ * snapshot 'i', or merge the handle i+stride into the handle 'i'. */
+void *vi_merge_main(void *arg) {
+	struct vi_merge_ctx *ctx = arg;
+
+	while (!ctx->failed) {
+		int i;
+
+#ifdef VI_HAVE_THREADS
+		pthread_mutex_lock(&ctx->lock);
+#endif
+		i = ctx->next;
+		ctx->next += ctx->stride ? ctx->stride*2 : 1;
+#ifdef VI_HAVE_THREADS
+		pthread_mutex_unlock(&ctx->lock);
+#endif
+		if (ctx->stride == 0) {
+			if (i >= ctx->n) break;
+			if (vi_snapshot_load(ctx->h[i], ctx->filenames[i])) {
+				char *err = strdup(vi_get_error(ctx->h[i]));
+
+				vi_set_error(ctx->h[i], "%s: %s", ctx->filenames[i],
+				             err ? err : "error");
+				free(err);
+				ctx->failed = 1;
+			}
+		} else {
+			if (i+ctx->stride >= ctx->n) break;
+			if (vi_merge(ctx->h[i], ctx->h[i+ctx->stride])) {
+				vi_set_error(ctx->h[i], "Out of memory merging snapshots");
+				ctx->failed = 1;
+			}
+			vi_free(ctx->h[i+ctx->stride]);
+			ctx->h[i+ctx->stride] = NULL;
+		}
+	}
+	return NULL;
+}
+
+/* Run a round of jobs using up to 'threads' threads */
+void vi_merge_round(struct vi_merge_ctx *ctx, int threads) {
+#ifdef VI_HAVE_THREADS
+	pthread_t tid[VI_THREADS_MAX];
+	int i, started = 0;
+
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&tid[started], NULL, vi_merge_main, ctx) == 0)
+			started++;
+	}
+	vi_merge_main(ctx); /* this thread works too */
+	for (i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+#else
+	(void) threads;
+	vi_merge_main(ctx);
+#endif
+}
+
+/* Load the 'filenamec' snapshots and add them all to the handle, using
+ * 'threads' threads. Returns zero on success, otherwise non-zero is
+ * returned and an error is set in the handle. */
+int vi_merge_snapshots(struct vih *vih, char **filenames, int filenamec,
+                       int threads) {
+	struct vi_merge_ctx ctx;
+	int i, retval = 0;
+
+	if (filenamec == 0) return 0;
+	ctx.filenames = filenames;
+	ctx.n = filenamec;
+	ctx.failed = 0;
+	if ((ctx.h = calloc(filenamec, sizeof(struct vih*))) == NULL)
+		goto oom;
+	for (i = 0; i < filenamec; i++) {
+		if ((ctx.h[i] = vi_new()) == NULL) goto oom;
+	}
+#ifdef VI_HAVE_THREADS
+	pthread_mutex_init(&ctx.lock, NULL);
+#endif
+	/* Load all the snapshots, then reduce them */
+	for (ctx.stride = 0; !ctx.failed && ctx.stride < filenamec;
+	     ctx.stride = ctx.stride ? ctx.stride*2 : 1) {
+		int jobs = ctx.stride ? (filenamec+ctx.stride*2-1)/(ctx.stride*2) :
+		                        filenamec;
+
+		ctx.next = 0;
+		vi_merge_round(&ctx, threads < jobs ? threads : jobs);
+	}
+#ifdef VI_HAVE_THREADS
+	pthread_mutex_destroy(&ctx.lock);
+#endif
+	if (ctx.failed) {
+		for (i = 0; i < filenamec; i++) {
+			if (ctx.h[i] && ctx.h[i]->error) {
+				vi_set_error(vih, "%s", vi_get_error(ctx.h[i]));
+				break;
+			}
+		}
+		retval = 1;
+	} else if (vi_merge(vih, ctx.h[0])) {
+		vi_set_error(vih, "Out of memory merging snapshots");
+		retval = 1;
+	}
+	goto cleanup;
+
+oom:
+	vi_set_error(vih, "Out of memory merging snapshots");
+	retval = 1;
+cleanup:
+	for (i = 0; ctx.h && i < filenamec; i++)
+		vi_free(ctx.h[i]);
+	free(ctx.h);
+	return retval;
+}
+
+#ifdef VI_HAVE_THREADS
+/* ------------------------------ parallel scan ----------------------------- */
+/* With --threads all the files that can be mapped in memory are split
+ * in jobs (whole small files, or chunks of big ones), that are dealt to
+ * a pool of workers. Every worker runs the jobs of its own queue, and
+ * once it is empty steals jobs from the queues of the other workers, so
+ * a single big file can't serialize the run. Every worker collects the
+ * statistics in a private handle, all merged at the end.
+ *
+ * Compressed files are processed as a whole by a single worker, unless
+ * --index is used and a seek index is available: then every range
+ * between two access points of the index is a job.
+ *
+ * W3C extended logs can't be parsed without the last #Fields: directive
+ * before the lines, so the directives of a file are collected while it
+ * is split, and every job starts with the layout in effect at its first
+ * line. Their compressed files are never split. */
+
+/* A range of lines of a mapped file, or a compressed file: the whole
+ * file, or the range of an access point of its seek index. */
+struct vi_job {
+	char *buf;
+	size_t len;
+	char *filename;		/* compressed file, if buf is NULL */
+	int type;		/* compression format */
+	struct vi_decomp_index *index;	/* seek index, or NULL */
+	int point;		/* access point of the range */
+	long long from;		/* uncompressed bytes already processed */
+	size_t cost;		/* estimated work, to deal bigger jobs first */
+	struct vi_w3c w3c;	/* W3C layout at the start of the range */
+};
+
+struct vi_worker {
+	pthread_t thread;
+	int started;
+	int id;
+	struct vih *vih;	/* private statistics */
+	struct vi_sched *sched;
+	pthread_mutex_t lock;	/* protects head and tail */
+	struct vi_job *jobs;	/* queue: jobs[head] to jobs[tail-1] */
+	int head, tail;
+	int retval;
+	struct vi_workerstat stat;
+};
+
+struct vi_sched {
+	struct vi_worker *worker;
+	int workers;
+	volatile int failed;	/* stop taking new jobs on errors */
+};
+
+/* Order jobs by cost, bigger first */
+int qsort_cmp_job_cost(const void *a, const void *b) {
+	const struct vi_job *A = a, *B = b;
+	if (A->cost > B->cost) return -1;
+	if (A->cost < B->cost) return 1;
+	return 0;
+}
+
+/* Return the next job for the worker 'w', taken from the head of its
+ * own queue or stolen from the tail of the queue of another worker.
+ * Returns zero when there are no more jobs. */
+int vi_sched_next_job(struct vi_worker *w, struct vi_job *job) {
+	struct vi_sched *sched = w->sched;
+	int i, found = 0;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->head < w->tail) {
+		*job = w->jobs[w->head++];
+		found = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+	for (i = 1; !found && i < sched->workers; i++) {
+		struct vi_worker *victim;
+
+		victim = &sched->worker[(w->id+i) % sched->workers];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head < victim->tail) {
+			*job = victim->jobs[--victim->tail];
+			found = 1;
+			w->stat.stolen++;
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+	return found;
+}
+
+void *vi_worker_main(void *arg) {
+	struct vi_worker *w = arg;
+	struct vi_job job;
+
+	while (!w->sched->failed && vi_sched_next_job(w, &job)) {
+		double start = vi_clock();
+		int processed = w->vih->processed;
+		long long bytes = w->vih->uncompressed_bytes;
+		int retval;
+
+		if (Parser == vi_parse_w3c)
+			w->vih->w3c = job.w3c;
+		if (job.buf)
+			retval = vi_scan_buffer(w->vih, job.buf, job.len);
+		else
+			retval = vi_scan_compressed(w->vih, job.filename, job.type,
+			                            job.index, job.point, job.from);
+		if (retval) {
+			w->retval = 1;
+			w->sched->failed = 1;
+		}
+		w->stat.jobs++;
+		if (job.buf)
+			w->stat.bytes += job.len;
+		else
+			w->stat.bytes += w->vih->uncompressed_bytes - bytes;
+		w->stat.lines += w->vih->processed - processed;
+		w->stat.busy += vi_clock() - start;
+	}
+	return NULL;
+}
+
+/* Append to 'jobs' the jobs needed to process the mapped file 'buf' of
+ * 'len' bytes, splitting it in chunks of about 'chunk' bytes ending
+ * just after a newline. 'w3c' is the W3C layout at the start of 'buf',
+ * updated with the directives of every chunk for the next one when W3C
+ * logs are parsed. Returns the new number of jobs. */
+int vi_sched_split(struct vi_job *jobs, int jobc, char *buf, size_t len,
+                   size_t chunk, struct vi_w3c *w3c) {
+	size_t start = 0;
+
+	while (start < len) {
+		size_t end = start+chunk;
+
+		if (end >= len) {
+			end = len;
+		} else {
+			char *nl = memchr(buf+end-1, '\n', len-end+1);
+			end = nl ? (size_t)(nl-buf)+1 : len;
+		}
+		jobs[jobc].buf = buf+start;
+		jobs[jobc].len = end-start;
+		jobs[jobc].filename = NULL;
+		jobs[jobc].index = NULL;
+		jobs[jobc].from = 0;
+		jobs[jobc].cost = end-start;
+		jobs[jobc].w3c = *w3c;
+		if (Parser == vi_parse_w3c)
+			vi_w3c_scan(w3c, buf+start, end-start);
+		jobc++;
+		start = end;
+	}
+	return jobc;
+}
+
+/* Process all the specified log files using 'threads' workers.
+ * Files that can't be mapped in memory (like the standard input) are
+ * processed sequentially with vi_scan() once the workers are done.
+ *
+ * If 'offsets' is not NULL only the data of every file after the offset
+ * it contains is processed, up to the end of the last complete line, and
+ * the offset is updated to the end of the processed data (see --state).
+ * A compressed file is skipped if the offset is its size, otherwise it
+ * is processed as a whole, or from the uncompressed offset in 'skips' if
+ * it is not NULL. Files that can't be mapped get offset -1.
+ *
+ * Returns zero on success, otherwise non-zero is returned and an error
+ * is set in the handle. */
+int vi_scan_files(struct vih *vih, char **filenames, int filenamec,
+                  int threads, long long *offsets, long long *skips) {
+	struct vi_sched sched;
+	struct vi_worker *w = NULL;
+	struct vi_job *jobs = NULL;
+	char **maps = NULL, **sequential = NULL;
+	size_t *lens = NULL, *starts = NULL, *ends = NULL;
+	int *types = NULL;
+	struct vi_decomp_index *indexes = NULL;
+	size_t total = 0, chunk;
+	int i, jobc = 0, maxjobs = 0, seqc = 0, retval = 0;
+
+	maps = calloc(filenamec, sizeof(char*));
+	lens = calloc(filenamec, sizeof(size_t));
+	starts = calloc(filenamec, sizeof(size_t));
+	ends = calloc(filenamec, sizeof(size_t));
+	types = calloc(filenamec, sizeof(int));
+	sequential = calloc(filenamec, sizeof(char*));
+	indexes = calloc(filenamec, sizeof(struct vi_decomp_index));
+	if (!maps || !lens || !starts || !ends || !types || !sequential ||
+	    !indexes) goto oom;
+	/* Map all the files */
+	for (i = 0; i < filenamec; i++) {
+		if (!strcmp(filenames[i], "-") ||
+		    vi_map_file(filenames[i], &maps[i], &lens[i]) == -1) {
+			maps[i] = NULL;
+			lens[i] = 0;
+			sequential[seqc++] = filenames[i];
+			if (offsets) offsets[i] = -1;
+			continue;
+		}
+		ends[i] = lens[i];
+		/* Compressed files can be split only using their index,
+		 * otherwise they are a single job. */
+		types[i] = vi_decomp_type((unsigned char*)maps[i],
+		        lens[i] < VI_COMP_MAGIC_LEN ? lens[i] : VI_COMP_MAGIC_LEN);
+		if (types[i] != VI_COMP_NONE) {
+			munmap(maps[i], lens[i]);
+			maps[i] = NULL;
+			if (offsets && offsets[i] == (long long)lens[i]) {
+				/* Already processed */
+				types[i] = VI_COMP_NONE;
+				lens[i] = ends[i] = 0;
+				continue;
+			}
+			if (offsets) offsets[i] = lens[i];
+			if (skips && skips[i]) {
+				maxjobs++;
+				continue;
+			}
+			if (Config_index && Parser != vi_parse_w3c &&
+			    vi_index_load(&indexes[i], filenames[i], types[i]) == 0)
+				maxjobs += indexes[i].points;
+			else
+				maxjobs++;
+			continue;
+		}
+		if (offsets) {
+			/* From the offset to the last complete line */
+			if (offsets[i] > 0 && offsets[i] <= (long long)lens[i])
+				starts[i] = offsets[i];
+			while (ends[i] > starts[i] && maps[i][ends[i]-1] != '\n')
+				ends[i]--;
+			offsets[i] = ends[i];
+		}
+		total += ends[i]-starts[i];
+	}
+	/* Enough chunks to keep all the workers busy till the end */
+	chunk = total/((size_t)(threads > 0 ? threads : 1)*VI_CHUNKS_PER_THREAD);
+	if (chunk > VI_CHUNK_BYTES) chunk = VI_CHUNK_BYTES;
+	if (chunk < VI_CHUNK_MIN) chunk = VI_CHUNK_MIN;
+	for (i = 0; i < filenamec; i++) {
+		if (maps[i] != NULL)
+			maxjobs += (ends[i]-starts[i])/chunk+1;
+	}
+	/* Split them in jobs. Bigger jobs are dealt first, so that the
+	 * initial load of the workers is already balanced. */
+	if ((jobs = malloc(sizeof(*jobs)*(maxjobs+1))) == NULL) goto oom;
+	for (i = 0; i < filenamec; i++) {
+		struct vi_decomp_index *idx = &indexes[i];
+		struct vi_w3c w3c;
+		int p;
+
+		vi_w3c_init(&w3c);
+
+		if (types[i] != VI_COMP_NONE && idx->points > 1) {
+			for (p = 0; p < idx->points; p++) {
+				long long end = p+1 < idx->points ?
+				        idx->point[p+1].out : idx->outsize;
+
+				jobs[jobc].buf = NULL;
+				jobs[jobc].len = 0;
+				jobs[jobc].filename = filenames[i];
+				jobs[jobc].type = types[i];
+				jobs[jobc].index = idx;
+				jobs[jobc].point = p;
+				jobs[jobc].from = 0;
+				jobs[jobc].cost = end - idx->point[p].out;
+				jobs[jobc].w3c = w3c;
+				jobc++;
+			}
+		} else if (types[i] != VI_COMP_NONE) {
+			jobs[jobc].buf = NULL;
+			jobs[jobc].len = lens[i];
+			jobs[jobc].filename = filenames[i];
+			jobs[jobc].type = types[i];
+			jobs[jobc].index = NULL;
+			jobs[jobc].point = 0;
+			jobs[jobc].from = skips ? skips[i] : 0;
+			jobs[jobc].cost = lens[i]*VI_DECOMP_RATIO;
+			jobs[jobc].w3c = w3c;
+			jobc++;
+		} else {
+			/* The data before the offset of --state may declare
+			 * the layout of the lines after it */
+			if (Parser == vi_parse_w3c)
+				vi_w3c_scan(&w3c, maps[i], starts[i]);
+			jobc = vi_sched_split(jobs, jobc, maps[i]+starts[i],
+			                      ends[i]-starts[i], chunk, &w3c);
+		}
+	}
+	qsort(jobs, jobc, sizeof(*jobs), qsort_cmp_job_cost);
+	if (threads > jobc) threads = jobc;
+	if (threads > 0) {
+		if ((w = calloc(threads, sizeof(*w))) == NULL) goto oom;
+		sched.worker = w;
+		sched.workers = threads;
+		sched.failed = 0;
+		for (i = 0; i < threads; i++) {
+			w[i].id = i;
+			w[i].sched = &sched;
+			pthread_mutex_init(&w[i].lock, NULL);
+			w[i].jobs = malloc(sizeof(*jobs)*(jobc/threads+1));
+			if ((w[i].vih = vi_new()) == NULL || w[i].jobs == NULL)
+				goto oom;
+		}
+		for (i = 0; i < jobc; i++) {
+			struct vi_worker *dst = &w[i % threads];
+			dst->jobs[dst->tail++] = jobs[i];
+		}
+		for (i = 0; i < threads; i++) {
+			if (pthread_create(&w[i].thread, NULL, vi_worker_main,
+			                   &w[i]) == 0)
+				w[i].started = 1;
+		}
+		/* If no thread at all could be started, run the jobs here */
+		for (i = 0; i < threads && !w[i].started; i++);
+		if (i == threads)
+			vi_worker_main(&w[0]);
+		for (i = 0; i < threads; i++) {
+			if (w[i].started)
+				pthread_join(w[i].thread, NULL);
+		}
+		/* Merge the results */
+		free(vih->workerstat);
+		vih->workerstat = malloc(sizeof(struct vi_workerstat)*threads);
+		vih->workers = vih->workerstat ? threads : 0;
+		for (i = 0; i < threads; i++) {
+			if (vih->workerstat)
+				vih->workerstat[i] = w[i].stat;
+			if (retval == 0 && w[i].retval) {
+				vi_set_error(vih, "%s", vi_get_error(w[i].vih));
+				retval = 1;
+			}
+			if (retval == 0 && vi_merge(vih, w[i].vih)) {
+				vi_set_error(vih, "Out of memory merging thread data");
+				retval = 1;
+			}
+		}
+	}
+	/* Process what can't be mapped in memory */
+	for (i = 0; retval == 0 && i < seqc; i++) {
+		if (vi_scan(vih, sequential[i])) {
+			vi_set_error(vih, "%s: %s", sequential[i], vi_get_error(vih));
+			retval = 1;
+		}
+	}
+	vih->endt = time(NULL);
+	goto cleanup;
+
+oom:
+	vi_set_error(vih, "Out of memory starting the parallel scan");
+	retval = 1;
+cleanup:
+	if (w) {
+		for (i = 0; i < threads; i++) {
+			vi_free(w[i].vih);
+			free(w[i].jobs);
+			if (w[i].sched)
+				pthread_mutex_destroy(&w[i].lock);
+		}
+		free(w);
+	}
+	for (i = 0; maps && i < filenamec; i++) {
+		if (maps[i]) munmap(maps[i], lens[i]);
+	}
+	for (i = 0; indexes && i < filenamec; i++)
+		vi_decomp_index_free(&indexes[i]);
+	free(indexes);
+	free(maps);
+	free(lens);
+	free(starts);
+	free(ends);
+	free(types);
+	free(sequential);
+	free(jobs);
+	return retval;
+}
+
+/* -------------------------------- saved state ----------------------------- */
+/* With --state the statistics and the position reached in every log file
+ * are saved in a file at the end of the run, and loaded at the start of
+ * the next one, so that only the data appended to the log files in the
+ * meantime is processed. Files are recognized by device and inode, so a
+ * file renamed by a log rotation is continued from where it was left.
+ *
+ * The hash of the bytes before the offset is saved too, and checked
+ * before to continue a file: if they changed the file was truncated and
+ * written again (logrotate copytruncate) and it is processed from the
+ * start. A file never seen before is compared the same way with the
+ * files that are gone, so a rotated log that was compressed afterwards
+ * (a new inode, the same content) is processed only after the offset
+ * reached when it was still a plain file.
+ *
+ * The state file is encoded like the snapshots: "VIST" version, the
+ * number of files followed by namelen name dev ino size offset
+ * compressed checked check for every file, then the snapshot of the
+ * statistics. 'checked' is zero if the bytes before the offset could not
+ * be read when the state was saved: the offset is then trusted. */
+#define VI_STATE_MAGIC "VIST"
+#define VI_STATE_VERSION 1
+
+/* Bytes before the offset of a file whose hash is saved */
+#define VI_STATE_CHECK 4096
+
+/* Position reached in a log file */
+struct vi_statefile {
+	char *filename;
+	long long dev;
+	long long ino;
+	long long size;
+	long long offset;	/* end of the processed data */
+	int compressed;		/* offset and size are of the compressed data */
+	int checked;		/* 'check' is valid */
+	unsigned long long check;	/* hash of the data before 'offset' */
+	int used;		/* already matched with a file of this run */
+};
+
+/* Compute in '*check' the hash of the VI_STATE_CHECK bytes (or less, at
+ * the start of the file) before the offset 'offset' of the file
+ * 'filename', after decompression if 'type' is not VI_COMP_NONE.
+ * Returns 0 on success, -1 if the file can't be read or is shorter. */
+int vi_state_check(char *filename, int type, long long offset,
+                   unsigned long long *check) {
+	struct vi_decomp d;
+	FILE *fp;
+	char *buf, win[VI_STATE_CHECK];
+	long long pos = 0;
+	size_t winlen = 0;
+	int retval = -1;
+
+	if ((fp = fopen(filename, "rb")) == NULL) return -1;
+	if (type == VI_COMP_NONE) {
+		winlen = offset < VI_STATE_CHECK ? offset : VI_STATE_CHECK;
+		if (fseeko(fp, offset-winlen, SEEK_SET) == 0 &&
+		    fread(win, 1, winlen, fp) == winlen) {
+			*check = __ht_fast_hash((u_int8_t*)win, winlen, 0);
+			retval = 0;
+		}
+		fclose(fp);
+		return retval;
+	}
+	if ((buf = malloc(VI_DECOMP_BUFLEN)) == NULL) {
+		fclose(fp);
+		return -1;
+	}
+	if (vi_decomp_open(&d, fp, type) == 0) {
+		/* Decompress up to the offset, keeping the last bytes */
+		while (pos < offset) {
+			long long want = offset-pos;
+			long got;
+			size_t n;
+
+			if (want > VI_DECOMP_BUFLEN) want = VI_DECOMP_BUFLEN;
+			if ((got = vi_decomp_read(&d, buf, want)) <= 0) break;
+			n = got;
+			pos += n;
+			if (n >= VI_STATE_CHECK) {
+				memcpy(win, buf+n-VI_STATE_CHECK, VI_STATE_CHECK);
+				winlen = VI_STATE_CHECK;
+			} else {
+				size_t keep = VI_STATE_CHECK-n < winlen ?
+				              VI_STATE_CHECK-n : winlen;
+
+				memmove(win, win+winlen-keep, keep);
+				memcpy(win+keep, buf, n);
+				winlen = keep+n;
+			}
+		}
+		if (pos == offset) {
+			*check = __ht_fast_hash((u_int8_t*)win, winlen, 0);
+			retval = 0;
+		}
+		vi_decomp_close(&d);
+	}
+	free(buf);
+	fclose(fp);
+	return retval;
+}
+
+/* Return non-zero if the data before the offset of the saved file 'sf'
+ * is still the same in the file 'filename' of compression 'type' */
+int vi_state_match(struct vi_statefile *sf, char *filename, int type) {
+	unsigned long long check;
+
+	if (!sf->checked) return 1;
+	return vi_state_check(filename, type, sf->offset, &check) == 0 &&
+	       check == sf->check;
+}
+
+/* Save the statistics of the handle and the 'filec' files positions in
+ * the state file 'filename'.
+ * Returns 0 on success, non-zero on error (set in the handle). */
+int vi_state_save(struct vih *vih, char *filename, struct vi_statefile *files,
+                  int filec) {
+	struct vi_buf b = {NULL, 0, 0, 0};
+	int i, retval;
+
+	vi_buf_put(&b, VI_STATE_MAGIC, 4);
+	vi_buf_varint(&b, VI_STATE_VERSION);
+	vi_buf_varint(&b, filec);
+	for (i = 0; i < filec; i++) {
+		size_t len = strlen(files[i].filename);
+
+		vi_buf_varint(&b, len);
+		vi_buf_put(&b, files[i].filename, len);
+		vi_buf_varint(&b, files[i].dev);
+		vi_buf_varint(&b, files[i].ino);
+		vi_buf_varint(&b, files[i].size);
+		vi_buf_varint(&b, files[i].offset);
+		vi_buf_varint(&b, files[i].compressed);
+		vi_buf_varint(&b, files[i].checked);
+		vi_buf_varint(&b, files[i].check);
+	}
+	if (vi_snapshot_encode(vih, &b)) {
+		vi_set_error(vih, "Out of memory saving the state");
+		free(b.p);
+		return 1;
+	}
+	retval = vi_write_file(vih, filename, b.p, b.len);
+	free(b.p);
+	return retval;
+}
+
+/* Load the state file 'filename' adding the statistics to the handle, and
+ * returning the files positions in '*files' and '*filec'.
+ * Returns 0 on success, non-zero on error (set in the handle). */
+int vi_state_load(struct vih *vih, char *filename, struct vi_statefile **files,
+                  int *filec) {
+	struct vi_statefile *f = NULL;
+	struct vi_reader r;
+	unsigned char *magic;
+	char *p = NULL;
+	size_t len = 0;
+	unsigned long long n = 0, i;
+	int mapped;
+
+	if (vi_read_file(vih, filename, &p, &len, &mapped)) return 1;
+	r.p = (unsigned char*) p;
+	r.end = r.p+len;
+	r.err = 0;
+	magic = vi_read_bytes(&r, 4);
+	if (magic == NULL || memcmp(magic, VI_STATE_MAGIC, 4) ||
+	    vi_read_varint(&r) != VI_STATE_VERSION) {
+		vi_set_error(vih, "Not a state file of this visited version");
+		goto err;
+	}
+	n = vi_read_varint(&r);
+	if (r.err || n > len || (f = calloc(n+1, sizeof(*f))) == NULL)
+		goto corrupted;
+	for (i = 0; i < n; i++) {
+		unsigned long long namelen = vi_read_varint(&r);
+		unsigned char *name = vi_read_bytes(&r, namelen);
+
+		if (r.err || (f[i].filename = malloc(namelen+1)) == NULL)
+			goto corrupted;
+		memcpy(f[i].filename, name, namelen);
+		f[i].filename[namelen] = '\0';
+		f[i].dev = vi_read_varint(&r);
+		f[i].ino = vi_read_varint(&r);
+		f[i].size = vi_read_varint(&r);
+		f[i].offset = vi_read_varint(&r);
+		f[i].compressed = vi_read_varint(&r) != 0;
+		f[i].checked = vi_read_varint(&r) != 0;
+		f[i].check = vi_read_varint(&r);
+	}
+	if (r.err) goto corrupted;
+	if (vi_snapshot_decode(vih, &r)) goto err;
+	vi_release_file(p, len, mapped);
+	*files = f;
+	*filec = n;
+	return 0;
+
+corrupted:
+	vi_set_error(vih, "Truncated or corrupted state file");
+err:
+	for (i = 0; f && i < n; i++)
+		free(f[i].filename);
+	free(f);
+	vi_release_file(p, len, mapped);
+	return 1;
+}
+
+/* Process the log files incrementally using the state file 'statefile':
+ * the saved statistics are loaded in the handle, only the data appended
+ * to the files since the last run is processed, then the new state is
+ * saved. A missing state file is just like an empty one. The position
+ * where the processed data of every file ends is stored in 'offsets',
+ * an array of 'filenamec' zeroed elements, see vi_scan_files().
+ * Returns zero on success, otherwise non-zero is returned and an error
+ * is set in the handle. */
+int vi_state_scan(struct vih *vih, char *statefile, char **filenames,
+                  int filenamec, long long *offsets) {
+	struct vi_statefile *saved = NULL, *files = NULL;
+	long long *skips = NULL;
+	int *seen = NULL;
+	int savedc = 0, filec = 0, i, j, retval = 1;
+
+	/* Load the previous state */
+	if (access(statefile, F_OK) == 0 &&
+	    vi_state_load(vih, statefile, &saved, &savedc)) {
+		vi_set_error(vih, "%s: %s", statefile, vi_get_error(vih));
+		return 1;
+	}
+	files = calloc(filenamec+1, sizeof(*files));
+	skips = calloc(filenamec+1, sizeof(long long));
+	seen = calloc(filenamec+1, sizeof(int));
+	if (!files || !skips || !seen) {
+		vi_set_error(vih, "Out of memory loading the state");
+		goto cleanup;
+	}
+	/* Continue every file from the saved position, unless it was
+	 * truncated or rewritten in the meantime. */
+	for (i = 0; i < filenamec; i++) {
+		struct stat sb;
+
+		if (stat(filenames[i], &sb) == -1) continue;
+		for (j = 0; j < savedc; j++) {
+			if (saved[j].dev == (long long)sb.st_dev &&
+			    saved[j].ino == (long long)sb.st_ino)
+				break;
+		}
+		if (j == savedc) continue;
+		seen[i] = 1;
+		/* On mismatch the inode was reused: the saved data may
+		 * still be found in another file below. */
+		if (saved[j].offset <= (long long)sb.st_size &&
+		    vi_state_match(&saved[j], filenames[i], VI_COMP_NONE)) {
+			offsets[i] = saved[j].offset;
+			saved[j].used = 1;
 		}
 	}
-	while (fgets(buf, VI_LINE_MAX, fp) != NULL) {
-		if (vi_process_line(vih, buf)) {
-			fclose(fp);
-			fprintf(stderr, "%s: %s\n", filename, vi_get_error(vih));
-			return 1;
+	/* A new file may be the copy of a file that is gone, like a
+	 * rotated log compressed after the last run. */
+	for (i = 0; i < filenamec; i++) {
+		int type;
+
+		if (seen[i] || access(filenames[i], R_OK)) continue;
+		type = vi_file_compression(filenames[i]);
+		for (j = 0; j < savedc; j++) {
+			if (saved[j].used || saved[j].compressed ||
+			    !saved[j].checked || saved[j].offset == 0 ||
+			    !vi_state_match(&saved[j], filenames[i], type))
+				continue;
+			saved[j].used = 1;
+			if (type == VI_COMP_NONE)
+				offsets[i] = saved[j].offset;
+			else
+				skips[i] = saved[j].offset;
+			break;
 		}
 	}
-	if (!use_stdin)
-		fclose(fp);
-	vih->endt = time(NULL);
-	return 0;
+	if (vi_scan_files(vih, filenames, filenamec, Config_threads, offsets,
+	                  skips))
+		goto cleanup;
+	/* Save the new state */
+	for (i = 0; i < filenamec; i++) {
+		struct stat sb;
+
+		if (offsets[i] == -1 || stat(filenames[i], &sb) == -1)
+			continue;
+		files[filec].filename = filenames[i];
+		files[filec].dev = sb.st_dev;
+		files[filec].ino = sb.st_ino;
+		files[filec].size = sb.st_size;
+		files[filec].offset = offsets[i];
+		files[filec].compressed =
+		        vi_file_compression(filenames[i]) != VI_COMP_NONE;
+		if (vi_state_check(filenames[i], VI_COMP_NONE, offsets[i],
+		                   &files[filec].check) == 0)
+			files[filec].checked = 1;
+		filec++;
+	}
+	retval = vi_state_save(vih, statefile, files, filec);
+
+cleanup:
+	for (i = 0; i < savedc; i++)
+		free(saved[i].filename);
+	free(saved);
+	free(files);
+	free(skips);
+	free(seen);
+	return retval;
 }
 
+#endif
+
 /* ---------------------------- text output module -------------------------- */
 void om_text_print_header(FILE *fp) {
 	fp = fp;
@@ -1475,33 +4338,34 @@ void om_text_print_subtitle(FILE *fp, char *subtitle) {
 	fprintf(fp, "--- %s\n", subtitle);
 }
 
-void om_text_print_numkey_info(FILE *fp, char *key, int val) {
-	fprintf(fp, "* %s: %d\n", key, val);
+void om_text_print_numkey_info(FILE *fp, char *key, long long val) {
+	fprintf(fp, "* %s: %lld\n", key, val);
 }
 
 void om_text_print_keykey_entry(FILE *fp, char *key1, char *key2, int num) {
 	fprintf(fp, "%d)    %s: %s\n", num, key1, key2);
 }
 
-void om_text_print_numkey_entry(FILE *fp, char *key, int val, char *link,
-                                int num) {
+void om_text_print_numkey_entry(FILE *fp, char *key, long long val,
+                                char *link, int num) {
 	link = link; /* avoid warning. Text output don't use this argument. */
-	fprintf(fp, "%d)    %s: %d\n", num, key, val);
+	fprintf(fp, "%d)    %s: %lld\n", num, key, val);
 }
 
 /* Print a bar, c1 and c2 are the colors of the left and right parts.
  * Max is the maximum value of the bar, the bar length is printed
  * to be porportional to max. tot is the "total" needed to compute
- * the precentage value. */
-void om_text_print_bar(FILE *fp, int max, int tot, int this, int cols,
-                       char c1, char c2) {
+ * the precentage value. The products are computed in floating point,
+ * as byte counts times the columns don't fit an integer. */
+void om_text_print_bar(FILE *fp, long long max, long long tot,
+                       long long this, int cols, char c1, char c2) {
 	int l;
-	float p;
+	double p;
 	char *bar;
 	if (tot == 0) tot++;
 	if (max == 0) max++;
-	l = ((float)(cols*this))/max;
-	p = ((float)(100*this))/tot;
+	l = ((double)cols*this)/max;
+	p = (100.0*this)/tot;
 	bar = malloc(cols+1);
 	if (!bar) return;
 	memset(bar, c2, cols+1);
@@ -1511,14 +4375,16 @@ void om_text_print_bar(FILE *fp, int max, int tot, int this, int cols,
 	free(bar);
 }
 
-void om_text_print_numkeybar_entry(FILE *fp, char *key, int max, int tot, int this) {
-	fprintf(fp, "   %-12s: %-9d |", key, this);
+void om_text_print_numkeybar_entry(FILE *fp, char *key, long long max,
+                                   long long tot, long long this) {
+	fprintf(fp, "   %-12s: %-9lld |", key, this);
 	om_text_print_bar(fp, max, tot, this, 44, '#', ' ');
 	fprintf(fp, "\n");
 }
 
-void om_text_print_numkeycomparativebar_entry(FILE *fp, char *key, int tot, int this) {
-	fprintf(fp, "   %s: %-10d |", key, this);
+void om_text_print_numkeycomparativebar_entry(FILE *fp, char *key,
+                                              long long tot, long long this) {
+	fprintf(fp, "   %s: %-10lld |", key, this);
 	om_text_print_bar(fp, tot, tot, this, 44, '#', '.');
 	fprintf(fp, "\n");
 }
@@ -1784,10 +4650,10 @@ void om_html_print_subtitle(FILE *fp, char *subtitle) {
 	fprintf(fp, "</td></tr>\n");
 }
 
-void om_html_print_numkey_info(FILE *fp, char *key, int val) {
+void om_html_print_numkey_info(FILE *fp, char *key, long long val) {
 	fprintf(fp, "<tr><td align=\"left\" colspan=\"3\" class=\"info\">");
 	om_html_entities(fp, key);
-	fprintf(fp, " %d", val);
+	fprintf(fp, " %lld", val);
 	fprintf(fp, "</td></tr>\n");
 }
 
@@ -1798,7 +4664,7 @@ void om_html_print_keykey_entry(FILE *fp, char *key1, char *key2, int num) {
 	om_html_entities(fp, key1);
 	fprintf(fp, "</td><td align=\"left\" class=\"keyentry\">");
 	
-	if (strncmp(key2, "http://", 7) || !strncmp(key2, "https://", 8) || !strncmp(key2, "ftp://", 6)) {
+	if (!strncmp(key2, "http://", 7) || !strncmp(key2, "https://", 8) || !strncmp(key2, "ftp://", 6)) {
 		fprintf(fp, "<a class=\"url\" href=\"%s\">", key2);
 		om_html_entities(fp, key2);
 		fprintf(fp, "</a>");
@@ -1808,12 +4674,12 @@ void om_html_print_keykey_entry(FILE *fp, char *key1, char *key2, int num) {
 	fprintf(fp, "</td></tr>\n");
 }
 
-void om_html_print_numkey_entry(FILE *fp, char *key, int val, char *link,
-                                int num) {
+void om_html_print_numkey_entry(FILE *fp, char *key, long long val,
+                                char *link, int num) {
 	fprintf(fp, "<tr><td align=\"left\" class=\"keyentry\">");
 	fprintf(fp, "%d)", num);
 	fprintf(fp, "<td align=\"left\" class=\"valueentry\">");
-	fprintf(fp, "%d", val);
+	fprintf(fp, "%lld", val);
 	fprintf(fp, "</td><td align=\"left\" class=\"keyentry\">");
 	if (link != NULL) {
 		fprintf(fp, "<a class=\"url\" href=\"%s\">", link);
@@ -1836,14 +4702,15 @@ void om_html_print_bar(FILE *fp, int l, char *leftclass, char *rightclass) {
 	fprintf(fp, "</table>\n");
 }
 
-void om_html_print_numkeybar_entry(FILE *fp, char *key, int max, int tot, int this) {
+void om_html_print_numkeybar_entry(FILE *fp, char *key, long long max,
+                                   long long tot, long long this) {
 	int l, weekend;
-	float p;
+	double p;
 
 	if (tot == 0) tot++;
 	if (max == 0) max++;
-	l = ((float)(100*this))/max;
-	p = ((float)(100*this))/tot;
+	l = (100.0*this)/max;
+	p = (100.0*this)/tot;
 	weekend = vi_is_weekend(key);
 
 	if (weekend)
@@ -1852,18 +4719,19 @@ void om_html_print_numkeybar_entry(FILE *fp, char *key, int max, int tot, int th
 		fprintf(fp, "<tr><td align=\"left\" class=\"keyentry\">");
 	om_html_entities(fp, key);
 	fprintf(fp, "&nbsp;&nbsp;&nbsp;</td><td align=\"left\" class=\"valueentry\">");
-	fprintf(fp, "%d (%02.1f%%)", this, p);
+	fprintf(fp, "%lld (%02.1f%%)", this, p);
 	fprintf(fp, "</td><td align=\"left\" class=\"bar\">");
 	om_html_print_bar(fp, l, "barfill", "barempty");
 	fprintf(fp, "</td></tr>\n");
 }
 
-void om_html_print_numkeycomparativebar_entry(FILE *fp, char *key, int tot, int this) {
+void om_html_print_numkeycomparativebar_entry(FILE *fp, char *key,
+                                              long long tot, long long this) {
 	int l, weekend;
-	float p;
+	double p;
 
 	if (tot == 0) tot++;
-	p = ((float)(100*this))/tot;
+	p = (100.0*this)/tot;
 	l = (int) p;
 	weekend = vi_is_weekend(key);
 
@@ -1873,7 +4741,7 @@ void om_html_print_numkeycomparativebar_entry(FILE *fp, char *key, int tot, int
 		fprintf(fp, "<tr><td align=\"left\" class=\"keyentry\">");
 	om_html_entities(fp, key);
 	fprintf(fp, "&nbsp;&nbsp;&nbsp;</td><td align=\"left\" class=\"valueentry\">");
-	fprintf(fp, "%d (%02.1f%%)", this, p);
+	fprintf(fp, "%lld (%02.1f%%)", this, p);
 	fprintf(fp, "</td><td align=\"left\" class=\"bar\">");
 	om_html_print_bar(fp, l, "barleft", "barright");
 	fprintf(fp, "</td></tr>\n");
@@ -1948,17 +4816,84 @@ struct outputmodule OutputModuleHtml = {
 /* ---------------------------------- output -------------------------------- */
 void vi_print_statistics(struct vih *vih) {
 	time_t elapsed = vih->endt - vih->startt;
+	struct fht *tables[VI_TABLES];
+	char *sep = "hot key cache hits:";
+	int i;
 
 	if (elapsed == 0) elapsed++;
 	fprintf(stderr, "--\n%d lines processed in %ld seconds\n"
 	        "%d invalid lines, %d blacklisted referers\n",
 	        vih->processed, (long) elapsed,
 	        vih->invalid, vih->blacklisted);
+	if (vih->compressed_bytes) {
+		double t = vih->decomp_time > 0 ? vih->decomp_time : 1e-9;
+
+		fprintf(stderr, "%.1f MB of compressed logs decompressed to "
+		        "%.1f MB, %.1f MB/s compressed, %.1f MB/s uncompressed\n",
+		        vih->compressed_bytes/1048576.0,
+		        vih->uncompressed_bytes/1048576.0,
+		        vih->compressed_bytes/1048576.0/t,
+		        vih->uncompressed_bytes/1048576.0/t);
+	}
+	for (i = 0; i < vih->workers; i++) {
+		struct vi_workerstat *ws = &vih->workerstat[i];
+		double busy = ws->busy > 0 ? ws->busy : 1e-9;
+
+		fprintf(stderr, "worker %d: %d jobs (%d stolen), %d lines, "
+		        "%.1f MB in %.2f seconds, %.1f MB/s\n",
+		        i, ws->jobs, ws->stolen, ws->lines,
+		        ws->bytes/1048576.0, ws->busy,
+		        ws->bytes/1048576.0/busy);
+	}
+	vi_get_tables(vih, tables);
+	for (i = 0; i < VI_TABLES; i++) {
+		if (tables[i]->lookups == 0) continue;
+		fprintf(stderr, "%s %s %.1f%%", sep, vi_table_names[i],
+		        tables[i]->cachehits*100.0/tables[i]->lookups);
+		sep = ",";
+	}
+	if (sep[0] == ',') fprintf(stderr, "\n");
+}
+
+/* Units the byte counts are printed in, see vi_size_unit() */
+char *vi_size_units[] = {"bytes", "KB", "MB", "GB", "TB"};
+
+/* Return the unit, as a power of 1024, a report whose biggest value is
+ * 'max' bytes is printed in: the biggest unit where 'max' is still at
+ * least 1000, so that small sites are not reported as 0 KB and huge
+ * ones don't need a dozen digits. */
+int vi_size_unit(long long max) {
+	int unit = 0;
+
+	while (unit < 4 && (max >> 10) >= 1000) {
+		max >>= 10;
+		unit++;
+	}
+	return unit;
+}
+
+/* Return 'size' bytes in the unit 'unit', rounded to the nearest */
+long long vi_size_scale(long long size, int unit) {
+	if (unit == 0) return size;
+	return (size + (1LL << (10*unit-1))) >> (10*unit);
+}
+
+/* Print the subtitle of a report, followed by the unit 'unit' of
+ * vi_size_unit() if the report is about traffic ('bytes' non-zero) */
+void vi_print_size_subtitle(FILE *fp, char *subtitle, int bytes, int unit) {
+	char buf[VI_LINE_MAX];
+
+	if (!bytes) {
+		Output->print_subtitle(fp, subtitle);
+		return;
+	}
+	snprintf(buf, sizeof(buf), "%s in %s", subtitle, vi_size_units[unit]);
+	Output->print_subtitle(fp, buf);
 }
 
 void vi_print_hours_report(FILE *fp, struct vih *vih) {
-	int i, max_hits = 0, tot_hits = 0;
-	long max_size = 0, tot_size = 0;
+	int i, max_hits = 0, tot_hits = 0, unit;
+	long long max_size = 0, tot_size = 0;
 	for (i = 0; i < 24; i++) {
 		if (vih->hour_hits[i] > max_hits)
 			max_hits = vih->hour_hits[i];
@@ -1976,18 +4911,23 @@ void vi_print_hours_report(FILE *fp, struct vih *vih) {
 			max_size = vih->hour_size[i];
 		tot_size += vih->hour_size[i];
 	}
+	unit = vi_size_unit(max_size);
 	Output->print_title(fp, "Hours distribution");
-	Output->print_subtitle(fp, "Percentage of traffic in every hour of the day");
+	vi_print_size_subtitle(fp, "Percentage of traffic in every hour of the day",
+	                       1, unit);
 	for (i = 0; i < 24; i++) {
 		char buf[8];
 		sprintf(buf, "%02d", i);
-		Output->print_numkeybar_entry(fp, buf, max_size, tot_size, vih->hour_size[i]);
+		Output->print_numkeybar_entry(fp, buf,
+		                              vi_size_scale(max_size, unit),
+		                              vi_size_scale(tot_size, unit),
+		                              vi_size_scale(vih->hour_size[i], unit));
 	}
 }
 
 void vi_print_weekdays_report(FILE *fp, struct vih *vih) {
-	int i, max_hits = 0, tot_hits = 0;
-	long max_size = 0, tot_size = 0;
+	int i, max_hits = 0, tot_hits = 0, unit;
+	long long max_size = 0, tot_size = 0;
 	for (i = 0; i < 7; i++) {
 		if (vih->weekday_hits[i] > max_hits)
 			max_hits = vih->weekday_hits[i];
@@ -2003,83 +4943,46 @@ void vi_print_weekdays_report(FILE *fp, struct vih *vih) {
 			max_size = vih->weekday_size[i];
 		tot_size += vih->weekday_size[i];
 	}
+	unit = vi_size_unit(max_size);
 	Output->print_title(fp, "Weekdays distribution");
-	Output->print_subtitle(fp, "Percentage of traffic in every day of the week");
+	vi_print_size_subtitle(fp, "Percentage of traffic in every day of the week",
+	                       1, unit);
 	for (i = 0; i < 7; i++) {
-		Output->print_numkeybar_entry(fp, vi_wdname[i], max_size, tot_size, vih->weekday_size[i]);
+		Output->print_numkeybar_entry(fp, vi_wdname[i],
+		                              vi_size_scale(max_size, unit),
+		                              vi_size_scale(tot_size, unit),
+		                              vi_size_scale(vih->weekday_size[i], unit));
 	}
 }
 
-/* Generic function for qsort(3) called to sort a table.
- * this function is actually only used by the following wrappers. */
-int qsort_cmp_dates_generic(const void *a, const void *b, int off, int mul) {
-	time_t ta, tb;
-	void **A = (void**) a;
-	void **B = (void**) b;
-	char *dateA = (char*) *(A+off);
-	char *dateB = (char*) *(B+off);
-
-	ta = parse_date(dateA, NULL);
-	tb = parse_date(dateB, NULL);
-	if (ta == (time_t)-1 && tb == (time_t)-1) return 0;
-	if (ta == (time_t)-1) return 1*mul;
-	if (tb == (time_t)-1) return -1*mul;
-	if (ta > tb) return 1*mul;
-	if (ta < tb) return -1*mul;
-	return 0;
+/* Compare the hits of two hashtable entries, higher first. Entries with
+ * the same value are ordered by key, so that the report does not depend
+ * on the layout of the hashtable (that changes with the order keys were
+ * added, for example when the tables of different threads are merged). */
+int qsort_cmp_entry_hits(const void *a, const void *b) {
+	struct fht_entry *A = *(struct fht_entry**) a;
+	struct fht_entry *B = *(struct fht_entry**) b;
+	if (A->hits > B->hits) return -1;
+	if (B->hits > A->hits) return 1;
+	return strcmp(A->key, B->key);
 }
 
-/* Compare dates in the log format: hashtable key part version */
-int qsort_cmp_dates_key(const void *a, const void *b) {
-	return qsort_cmp_dates_generic(a, b, 0, 1);
+/* The same for the traffic of the entries */
+int qsort_cmp_entry_bytes(const void *a, const void *b) {
+	struct fht_entry *A = *(struct fht_entry**) a;
+	struct fht_entry *B = *(struct fht_entry**) b;
+	if (A->bytes > B->bytes) return -1;
+	if (B->bytes > A->bytes) return 1;
+	return strcmp(A->key, B->key);
 }
 
-/* Compare dates (only the month/year part) in the log format:
- * hashtable key part version */
-int qsort_cmp_months_key(const void *a, const void *b) {
-	int ret;
-	char dateA[VI_DATE_MAX];
-	char dateB[VI_DATE_MAX];
-	void *savedA, *savedB; /* backups of the original pointers */
-	void **A = (void**) a;
-	void **B = (void**) b;
-
-	/* We use an hack here, in order to call qsort_cmp_dates_generic
-	 * even in this case, we substitute the hashtable entries
-	 * with versions of the strings prefixed with "01", so they
-	 * will be parseble by parse_date().
-	 * In pratice for "May/2004" we instead put "01/May/2004" and so on. */
-	savedA = *A;
-	savedB = *B;
-	dateA[0] = dateB[0] = '0';
-	dateA[1] = dateB[1] = '1';
-	dateA[2] = dateB[2] = '/';
-	dateA[3] = dateB[3] = '\0';
-	vi_strlcat(dateA, (char*)*A, VI_DATE_MAX);
-	vi_strlcat(dateB, (char*)*B, VI_DATE_MAX);
-	*A = dateA;
-	*B = dateB;
-	ret = qsort_cmp_dates_generic(a, b, 0, 1);
-	/* Restore */
-	*A = savedA;
-	*B = savedB;
-	return ret;
-}
-
-/* Compare dates in the log format: hashtable value part version.
- * this sorts in reverse order, more recent dates first. */
-int qsort_cmp_dates_value(const void *a, const void *b) {
-	return qsort_cmp_dates_generic(a, b, 1, -1);
-}
-
-int qsort_cmp_long_value(const void *a, const void *b) {
-	void **A = (void**) a;
-	void **B = (void**) b;
-	long la = (long) *(A+1);
-	long lb = (long) *(B+1);
-	if (la > lb) return -1;
-	if (lb > la) return 1;
-	return 0;
+/* The same for the time of the last request, most recent first */
+int qsort_cmp_entry_last(const void *a, const void *b) {
+	struct fht_entry *A = *(struct fht_entry**) a;
+	struct fht_entry *B = *(struct fht_entry**) b;
+	if (A->last > B->last) return -1;
+	if (B->last > A->last) return 1;
+	return strcmp(A->key, B->key);
 }
 
 int qsort_cmp_time_value(const void *a, const void *b) {
@@ -2092,114 +4995,97 @@ int qsort_cmp_time_value(const void *a, const void *b) {
 	return 0;
 }
 
-void vi_print_hits_report(FILE *fp, struct vih *vih) {
-	int days = ht_used(&vih->date), i, tot = 0, max = 0;
-	int months;
-	void **table;
-
-	Output->print_title(fp, "Daily hits");
-	Output->print_subtitle(fp, "Hits in each day");
-	Output->print_numkey_info(fp, "Number of users",
-	                          ht_used(&vih->users_hits));
-	Output->print_numkey_info(fp, "Different days in logfile",
-	                          ht_used(&vih->date));
-
-	if ((table = ht_get_array(&vih->date)) == NULL) {
-		fprintf(stderr, "Out Of Memory in print_hits_report()\n");
-		return;
-	}
-	qsort(table, days, sizeof(void*)*2, qsort_cmp_dates_key);
-	for (i = 0; i < days; i++) {
-		long value = (long) table[(i*2)+1];
+/* Print the counters of the series 'sr' that have a non-zero counter
+ * in the series 'present', in the order of the index: days are printed
+ * as "dd/Mon/yyyy", months as "Mon/yyyy". The counters are printed in
+ * the unit 'unit' of vi_size_unit(), zero if they are not bytes. */
+void vi_print_series(FILE *fp, struct vi_series *sr, struct vi_series *present,
+                     int months, int unit) {
+	int i, idx, y, m, d;
+	long long value, tot = 0, max = 0;
+	char key[VI_DATE_MAX];
+
+	for (i = 0; i < present->len; i++) {
+		if (!present->counter[i]) continue;
+		value = vi_series_get(sr, present->first+i);
 		if (value > max)
 			max = value;
 		tot += value;
 	}
-	for (i = 0; i < days; i++) {
-		char *key = table[i*2];
-		long value = (long) table[(i*2)+1];
+	max = vi_size_scale(max, unit);
+	tot = vi_size_scale(tot, unit);
+	for (i = 0; i < present->len; i++) {
+		if (!present->counter[i]) continue;
+		idx = present->first+i;
+		if (months) {
+			y = 1970 + (idx >= 0 ? idx/12 : (idx-11)/12);
+			m = idx - (y-1970)*12;
+			snprintf(key, sizeof(key), "%s/%d", vi_month_name[m], y);
+		} else {
+			vi_civil_from_days(idx, &y, &m, &d);
+			snprintf(key, sizeof(key), "%02d/%s/%d", d,
+			         vi_month_name[m-1], y);
+		}
+		value = vi_size_scale(vi_series_get(sr, idx), unit);
 		Output->print_numkeybar_entry(fp, key, max, tot, value);
 	}
-	free(table);
+}
+
+void vi_print_hits_report(FILE *fp, struct vih *vih) {
+	int unit;
+
+	Output->print_title(fp, "Daily hits");
+	Output->print_subtitle(fp, "Hits in each day");
+	Output->print_numkey_info(fp, "Number of users",
+	                          fht_used(&vih->users));
+	Output->print_numkey_info(fp, "Different days in logfile",
+	                          vi_series_used(&vih->date));
+	vi_print_series(fp, &vih->date, &vih->date, 0, 0);
 	Output->print_hline(fp);
 
 	/* Monthly  hits*/
 	if (Config_process_monthly_hits == 0) return;
-	tot = max = 0;
-	months = ht_used(&vih->month_hits);
 	Output->print_title(fp, "Monthly hits");
-	Output->print_subtitle(fp, "Hits in each month in KB");
+	Output->print_subtitle(fp, "Hits in each month");
 	Output->print_numkey_info(fp, "Number of users",
-	                          ht_used(&vih->users_hits));
+	                          fht_used(&vih->users));
 	Output->print_numkey_info(fp, "Different months in logfile",
-	                          ht_used(&vih->month_hits));
-
-	if ((table = ht_get_array(&vih->month_hits)) == NULL) {
-		fprintf(stderr, "Out of memory in print_hits_report()\n");
-		return;
-	}
-	qsort(table, months, sizeof(void*)*2, qsort_cmp_months_key);
-	for (i = 0; i < months; i++) {
-		long value = (long) table[(i*2)+1];
-		if (value > max)
-			max = value;
-		tot += value;
-	}
-	for (i = 0; i < months; i++) {
-		char *key = table[i*2];
-		long value = (long) table[(i*2)+1];
-		Output->print_numkeybar_entry(fp, key, max, tot, value);
-	}
-	free(table);
+	                          vi_series_used(&vih->month_hits));
+	vi_print_series(fp, &vih->month_hits, &vih->month_hits, 1, 0);
 
 	/* Monthly size */
 	if (Config_process_monthly_hits == 0) return;
-	tot = max = 0;
-	months = ht_used(&vih->month_size);
+	unit = vi_size_unit(vi_series_max(&vih->month_size));
 	Output->print_title(fp, "Monthly size");
-	Output->print_subtitle(fp, "Size in each month in KB");
+	vi_print_size_subtitle(fp, "Size in each month", 1, unit);
 	Output->print_numkey_info(fp, "Number of users",
-	                          ht_used(&vih->users_size));
+	                          fht_used(&vih->users));
 	Output->print_numkey_info(fp, "Different months in logfile",
-	                          ht_used(&vih->month_size));
-
-	if ((table = ht_get_array(&vih->month_size)) == NULL) {
-		fprintf(stderr, "Out of memory in print_hits_report()\n");
-		return;
-	}
-	qsort(table, months, sizeof(void*)*2, qsort_cmp_months_key);
-	for (i = 0; i < months; i++) {
-		long value = (long) table[(i*2)+1];
-		if (value > max)
-			max = value;
-		tot += value;
-	}
-	for (i = 0; i < months; i++) {
-		char *key = table[i*2];
-		long value = (long) table[(i*2)+1];
-		Output->print_numkeybar_entry(fp, key, max, tot, value);
-	}
-	free(table);
+	                          vi_series_used(&vih->month_hits));
+	vi_print_series(fp, &vih->month_size, &vih->month_hits, 1, unit);
 }
 
+/* Print the 'items' entries of 'table', a hashtable already sorted, with
+ * their hits. If 'bytes' is non-zero the traffic is printed instead, in
+ * the unit that fits the biggest value. */
 void vi_print_generic_keyval_report(FILE *fp, char *title, char *subtitle,
                                     char *info, int maxlines,
-                                    struct hashtable *ht,
-                                    int(*compar)(const void *, const void *)) {
-	int items = ht_used(ht), i;
-	void **table;
+                                    struct fht_entry **table, int items,
+                                    int bytes) {
+	int i, unit = 0;
+	long long max = 0;
 
 	Output->print_title(fp, title);
-	Output->print_subtitle(fp, subtitle);
-	Output->print_numkey_info(fp, info, items);
-	if ((table = ht_get_array(ht)) == NULL) {
-		fprintf(stderr, "Out of memory in print_generic_report()\n");
-		return;
+	for (i = 0; bytes && i < items; i++) {
+		if (table[i]->bytes > max) max = table[i]->bytes;
 	}
-	qsort(table, items, sizeof(void*)*2, compar);
+	if (bytes) unit = vi_size_unit(max);
+	vi_print_size_subtitle(fp, subtitle, bytes, unit);
+	Output->print_numkey_info(fp, info, items);
 	for (i = 0; i < items; i++) {
-		char *key = table[i*2];
-		long value = (long) table[(i*2)+1];
+		char *key = table[i]->key;
+		long long value = vi_size_scale(bytes ? table[i]->bytes :
+		                                table[i]->hits, unit);
 		if (i >= maxlines) break;
 		if (key[0] == '\0')
 			Output->print_numkey_entry(fp, "none", value, NULL,
@@ -2207,183 +5093,218 @@ void vi_print_generic_keyval_report(FILE *fp, char *title, char *subtitle,
 		else
 			Output->print_numkey_entry(fp, key, value, NULL, i+1);
 	}
-	free(table);
 }
 
+/* Like vi_print_generic_keyval_report(), with a bar showing the share
+ * of every entry. */
 void vi_print_generic_keyvalbar_report(FILE *fp, char *title, char *subtitle,
                                        char *info, int maxlines,
-                                       struct hashtable *ht,
-                                       int(*compar)(const void *, const void *)) {
-	int items = ht_used(ht), i, max = 0, tot = 0;
-	void **table;
+                                       struct fht_entry **table, int items,
+                                       int bytes) {
+	int i, unit = 0;
+	long long max = 0, tot = 0;
 
 	Output->print_title(fp, title);
-	Output->print_subtitle(fp, subtitle);
-	Output->print_numkey_info(fp, info, items);
-	if ((table = ht_get_array(ht)) == NULL) {
-		fprintf(stderr, "Out of memory in print_generic_report()\n");
-		return;
-	}
-	qsort(table, items, sizeof(void*)*2, compar);
 	for (i = 0; i < items; i++) {
-		long value = (long) table[(i*2)+1];
+		long long value = bytes ? table[i]->bytes : table[i]->hits;
 		tot += value;
 		if (value > max) max = value;
 	}
+	if (bytes) {
+		unit = vi_size_unit(max);
+		max = vi_size_scale(max, unit);
+		tot = vi_size_scale(tot, unit);
+	}
+	vi_print_size_subtitle(fp, subtitle, bytes, unit);
+	Output->print_numkey_info(fp, info, items);
 	for (i = 0; i < items; i++) {
-		char *key = table[i*2];
-		long value = (long) table[(i*2)+1];
+		char *key = table[i]->key;
+		long long value = vi_size_scale(bytes ? table[i]->bytes :
+		                                table[i]->hits, unit);
 		if (i >= maxlines) break;
 		if (key[0] == '\0')
 			Output->print_numkeybar_entry(fp, "none", max, tot, value);
 		else
 			Output->print_numkeybar_entry(fp, key, max, tot, value);
 	}
+}
+
+/* Format the time 't' of a request as "dd/Mon/yyyy hh:mm:ss" in 'buf' */
+void vi_format_seen(char *buf, size_t len, long long t) {
+	struct tm tm;
+
+	vi_localtime((time_t) t, &tm);
+	strftime(buf, len, "%d/%b/%Y %H:%M:%S", &tm);
+}
+
+/* Print the 'items' entries of 'table', a hashtable already sorted, with
+ * the time of their first and of their last request. */
+void vi_print_generic_seen_report(FILE *fp, char *title, char *subtitle,
+                                  char *info, int maxlines,
+                                  struct fht_entry **table, int items) {
+	char first[64], last[64], range[160];
+	int i;
+
+	Output->print_title(fp, title);
+	Output->print_subtitle(fp, subtitle);
+	Output->print_numkey_info(fp, info, items);
+	for (i = 0; i < items && i < maxlines; i++) {
+		char *key = table[i]->key;
+
+		vi_format_seen(first, sizeof(first), table[i]->first);
+		vi_format_seen(last, sizeof(last), table[i]->last);
+		snprintf(range, sizeof(range), "%s - %s", first, last);
+		Output->print_keykey_entry(fp, range,
+		                           key[0] == '\0' ? "none" : key, i+1);
+	}
+}
+
+/* Print the reports of the hashtable 'ht' by hits and by size, titled
+ * "<name> by hits" and "<name> by size" and described by "<description>
+ * by hits" and so on, with a bar if 'bar' is non-zero. If 'seen' is
+ * non-zero the report "<name> by last request" is printed too. The hits,
+ * the traffic and the times are read from the same array of entries,
+ * sorted again for every report. */
+void vi_print_traffic_reports(FILE *fp, struct fht *ht, char *name,
+                              char *description, char *info, int maxlines,
+                              int bar, int seen) {
+	int items = fht_used(ht);
+	struct fht_entry **table;
+	char title[128], subtitle[256];
+
+	if ((table = fht_get_entries(ht)) == NULL) {
+		fprintf(stderr, "Out of memory in print_traffic_reports()\n");
+		return;
+	}
+	qsort(table, items, sizeof(*table), qsort_cmp_entry_hits);
+	snprintf(title, sizeof(title), "%s by hits", name);
+	snprintf(subtitle, sizeof(subtitle), "%s by hits", description);
+	if (bar)
+		vi_print_generic_keyvalbar_report(fp, title, subtitle, info,
+		                                  maxlines, table, items, 0);
+	else
+		vi_print_generic_keyval_report(fp, title, subtitle, info,
+		                               maxlines, table, items, 0);
+	qsort(table, items, sizeof(*table), qsort_cmp_entry_bytes);
+	snprintf(title, sizeof(title), "%s by size", name);
+	snprintf(subtitle, sizeof(subtitle), "%s by size", description);
+	if (bar)
+		vi_print_generic_keyvalbar_report(fp, title, subtitle, info,
+		                                  maxlines, table, items, 1);
+	else
+		vi_print_generic_keyval_report(fp, title, subtitle, info,
+		                               maxlines, table, items, 1);
+	if (seen) {
+		qsort(table, items, sizeof(*table), qsort_cmp_entry_last);
+		snprintf(title, sizeof(title), "%s by last request", name);
+		snprintf(subtitle, sizeof(subtitle),
+		         "%s by the time of the last request, with the first one",
+		         description);
+		vi_print_generic_seen_report(fp, title, subtitle, info,
+		                             maxlines, table, items);
+	}
 	free(table);
 }
 
 void vi_print_pages_report(FILE *fp, struct vih *vih) {
-	vi_print_generic_keyval_report(
-	    fp,
-	    "Pages by hits",
-	    "Page requests ordered by hits",
-	    "Different pages requested",
-	    Config_max_pages,
-	    &vih->pages_hits,
-	    qsort_cmp_long_value);
-	vi_print_generic_keyval_report(
-	    fp,
-	    "Pages by size",
-	    "Page requests ordered by size in KB",
-	    "Different pages requested",
-	    Config_max_pages,
-	    &vih->pages_size,
-	    qsort_cmp_long_value);
+	vi_print_traffic_reports(fp, &vih->pages, "Pages",
+	    "Page requests ordered", "Different pages requested",
+	    Config_max_pages, 0, 0);
 }
 
 void vi_print_error404_report(FILE *fp, struct vih *vih) {
+	int items = fht_used(&vih->error404);
+	struct fht_entry **table;
+
+	if ((table = fht_get_entries(&vih->error404)) == NULL) {
+		fprintf(stderr, "Out of memory in print_error404_report()\n");
+		return;
+	}
+	qsort(table, items, sizeof(*table), qsort_cmp_entry_hits);
 	vi_print_generic_keyval_report(
 	    fp,
 	    "404 Errors",
 	    "Requests for missing documents",
 	    "Different missing documents requested",
 	    Config_max_error404,
-	    &vih->error404,
-	    qsort_cmp_long_value);
+	    table, items,
+	    0);
+	free(table);
 }
 
 void vi_print_types_report(FILE *fp, struct vih *vih) {
-	vi_print_generic_keyvalbar_report(
-	    fp,
-	    "File types by hits",
-	    "Requested file types ordered by hits",
-	    "Different file types requested",
-	    Config_max_types,
-	    &vih->types_hits,
-	    qsort_cmp_long_value);
-	vi_print_generic_keyvalbar_report(
-	    fp,
-	    "File types by size",
-	    "Requested file types ordered by size in KB",
-	    "Different file types requested",
-	    Config_max_types,
-	    &vih->types_size,
-	    qsort_cmp_long_value);
+	vi_print_traffic_reports(fp, &vih->types, "File types",
+	    "Requested file types ordered", "Different file types requested",
+	    Config_max_types, 1, 0);
 }
 
 void vi_print_codes_report(FILE *fp, struct vih *vih) {
-	vi_print_generic_keyvalbar_report(
-	    fp,
-	    "Codes by hits",
-	    "HTTP codes ordered by hits",
-	    "Different HTTP codes",
-	    Config_max_codes,
-	    &vih->codes_hits,
-	    qsort_cmp_long_value);
-	vi_print_generic_keyvalbar_report(
-	    fp,
-	    "Codes by size",
-	    "HTTP codes ordered by size in KB",
-	    "Different HTTP codes",
-	    Config_max_codes,
-	    &vih->codes_size,
-	    qsort_cmp_long_value);
+	vi_print_traffic_reports(fp, &vih->codes, "Codes",
+	    "HTTP codes ordered", "Different HTTP codes",
+	    Config_max_codes, 1, 0);
+}
+
+/* Return non-zero if the squid result code 'result' means that the
+ * request was served from the cache, like TCP_HIT, TCP_MEM_HIT or
+ * TCP_REFRESH_UNMODIFIED. */
+int vi_is_cache_hit(char *result) {
+	return strstr(result, "HIT") != NULL ||
+	       strstr(result, "UNMODIFIED") != NULL;
+}
+
+void vi_print_cache_report(FILE *fp, struct vih *vih) {
+	long long hits = 0, size = 0, tothits = 0, totsize = 0;
+	unsigned int i;
+	int unit;
+	char buf[VI_LINE_MAX];
+
+	vi_print_traffic_reports(fp, &vih->results, "Cache results",
+	    "Squid cache result codes ordered", "Different cache result codes",
+	    Config_max_codes, 1, 0);
+	for (i = 0; i < fht_size(&vih->results); i++) {
+		struct fht_entry *e = fht_entry(&vih->results, i);
+
+		if (!fht_busy(&vih->results, i)) continue;
+		tothits += e->hits;
+		totsize += e->bytes;
+		if (vi_is_cache_hit(e->key)) {
+			hits += e->hits;
+			size += e->bytes;
+		}
+	}
+	unit = vi_size_unit(totsize);
+	Output->print_title(fp, "Cache hit ratio");
+	snprintf(buf, sizeof(buf), "Requests and traffic in %s served from the cache",
+	         vi_size_units[unit]);
+	Output->print_subtitle(fp, buf);
+	Output->print_numkeycomparativebar_entry(fp, "Requests", tothits, hits);
+	Output->print_numkeycomparativebar_entry(fp, "Traffic ",
+	                                         vi_size_scale(totsize, unit),
+	                                         vi_size_scale(size, unit));
 }
 
 void vi_print_sites_report(FILE *fp, struct vih *vih) {
-	vi_print_generic_keyvalbar_report(
-	    fp,
-	    "Sites by hits",
-	    "Sites sorted by hits",
-	    "Total number of sites",
-	    Config_max_sites,
-	    &vih->sites_hits,
-	    qsort_cmp_long_value);
-	vi_print_generic_keyvalbar_report(
-	    fp,
-	    "Sites by size",
-	    "Sites sorted by size in KB",
-	    "Total number of sites",
-	    Config_max_sites,
-	    &vih->sites_size,
-	    qsort_cmp_long_value);
+	vi_print_traffic_reports(fp, &vih->sites, "Sites",
+	    "Sites sorted", "Total number of sites",
+	    Config_max_sites, 1, 0);
 }
 
 void vi_print_hosts_report(FILE *fp, struct vih *vih) {
-	vi_print_generic_keyvalbar_report(
-	    fp,
-	    "Hosts by hits",
-	    "Hosts sorted by hits",
-	    "Total number of hosts",
-	    Config_max_hosts,
-	    &vih->hosts_hits,
-	    qsort_cmp_long_value);
-	vi_print_generic_keyvalbar_report(
-	    fp,
-	    "Hosts by size",
-	    "Hosts sorted by size in KB",
-	    "Total number of hosts",
-	    Config_max_hosts,
-	    &vih->hosts_size,
-	    qsort_cmp_long_value);
+	vi_print_traffic_reports(fp, &vih->hosts, "Hosts",
+	    "Hosts sorted", "Total number of hosts",
+	    Config_max_hosts, 1, 1);
 }
 
 void vi_print_users_report(FILE *fp, struct vih *vih) {
-	vi_print_generic_keyvalbar_report(
-	    fp,
-	    "Users by hits",
-	    "Users sorted by hits",
-	    "Total number of users",
-	    Config_max_hosts,
-	    &vih->users_hits,
-	    qsort_cmp_long_value);
-	vi_print_generic_keyvalbar_report(
-	    fp,
-	    "Users by size",
-	    "Users sorted by size in KB",
-	    "Total number of users",
-	    Config_max_hosts,
-	    &vih->users_size,
-	    qsort_cmp_long_value);
+	vi_print_traffic_reports(fp, &vih->users, "Users",
+	    "Users sorted", "Total number of users",
+	    Config_max_hosts, 1, 1);
 }
 
 void vi_print_verbs_report(FILE *fp, struct vih *vih) {
-	vi_print_generic_keyvalbar_report(
-	    fp,
-	    "Methods by hits",
-	    "HTTP methods sorted by hits",
-	    "Total number of methods",
-	    100,
-	    &vih->verbs_hits,
-	    qsort_cmp_long_value);
-	vi_print_generic_keyvalbar_report(
-	    fp,
-	    "Methods by size",
-	    "HTTP methods sorted by size in KB",
-	    "Total number of methods",
-	    100,
-	    &vih->verbs_size,
-	    qsort_cmp_long_value);
+	vi_print_traffic_reports(fp, &vih->verbs, "Methods",
+	    "HTTP methods sorted", "Total number of methods",
+	    100, 1, 0);
 }
 
 /* Print a generic report where the two report items are strings
@@ -2443,12 +5364,17 @@ void vi_print_report_links(FILE *fp) {
 		"File types by size", &Config_process_types,
 		"Users by hits", &Config_process_users,
 		"Users by size", &Config_process_users,
+		"Users by last request", &Config_process_users,
 		"Hosts by hits", &Config_process_hosts,
 		"Hosts by size", &Config_process_hosts,
+		"Hosts by last request", &Config_process_hosts,
 		"Codes by hits", &Config_process_codes,
 		"Codes by size", &Config_process_codes,
 		"Methods by hits", &Config_process_verbs,
 		"Methods by size", &Config_process_verbs,
+		"Cache results by hits", &Config_process_cache,
+		"Cache results by size", &Config_process_cache,
+		"Cache hit ratio", &Config_process_cache,
 		"404 Errors", &Config_process_error404,
 		"Weekday distribution", NULL,
 		"Hours distribution", NULL,
@@ -2480,8 +5406,9 @@ void vi_print_weekdayhour_map_report(FILE *fp, struct vih *vih) {
 		"16", "17", "18", "19", "20", "21", "22", "23"
 	};
 	char **ylabel = vi_wdname;
-	int j, minj = 0, maxj = 0;
-	int *hw = (int*) vih->weekdayhour_hits;
+	int j, minj = 0, maxj = 0, unit;
+	int *hw = (int*) vih->weekdayhour_hits, map[24*7];
+	long long *size;
 	char buf[VI_LINE_MAX];
 
 	/* Check indexes of minimum and maximum in the array. */
@@ -2504,27 +5431,31 @@ void vi_print_weekdayhour_map_report(FILE *fp, struct vih *vih) {
 	Output->print_bidimentional_map(fp, 24, 7, xlabel, ylabel, hw);
 
 	/* do sizes now */
-	hw = (int*) vih->weekdayhour_size;
+	size = &vih->weekdayhour_size[0][0];
 	minj = 0, maxj = 0;
 
 	/* Check indexes of minimum and maximum in the array. */
 	for (j = 0; j < 24*7; j++) {
-		if (hw[j] > hw[maxj])
+		if (size[j] > size[maxj])
 			maxj = j;
-		if (hw[j] < hw[minj])
+		if (size[j] < size[minj])
 			minj = j;
 	}
+	/* The map is drawn from the sizes in the unit of the maximum */
+	unit = vi_size_unit(size[maxj]);
+	for (j = 0; j < 24*7; j++)
+		map[j] = vi_size_scale(size[j], unit);
 
 	Output->print_title(fp, "Weekday-Hour combined map");
 	Output->print_subtitle(fp, "Brighter means higher level of traffic");
-	snprintf(buf, VI_LINE_MAX, "Hour with max traffic starting at %s %s:00 with size",
-	         ylabel[maxj/24], xlabel[maxj%24]);
-	Output->print_numkey_info(fp, buf, hw[maxj]);
-	snprintf(buf, VI_LINE_MAX, "Hour with min traffic starting at %s %s:00 with size",
-	         ylabel[minj/24], xlabel[minj%24]);
-	Output->print_numkey_info(fp, buf, hw[minj]);
+	snprintf(buf, VI_LINE_MAX, "Hour with max traffic starting at %s %s:00 with size in %s",
+	         ylabel[maxj/24], xlabel[maxj%24], vi_size_units[unit]);
+	Output->print_numkey_info(fp, buf, map[maxj]);
+	snprintf(buf, VI_LINE_MAX, "Hour with min traffic starting at %s %s:00 with size in %s",
+	         ylabel[minj/24], xlabel[minj%24], vi_size_units[unit]);
+	Output->print_numkey_info(fp, buf, map[minj]);
 	Output->print_hline(fp);
-	Output->print_bidimentional_map(fp, 24, 7, xlabel, ylabel, hw);
+	Output->print_bidimentional_map(fp, 24, 7, xlabel, ylabel, map);
 }
 
 void vi_print_monthday_map_report(FILE *fp, struct vih *vih) {
@@ -2538,8 +5469,9 @@ void vi_print_monthday_map_report(FILE *fp, struct vih *vih) {
 		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
 		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
 	};
-	int j, minj = 0, maxj = 0;
-	int *md = (int*) vih->monthday_hits;
+	int j, minj = 0, maxj = 0, unit;
+	int *md = (int*) vih->monthday_hits, map[12*31];
+	long long *size;
 	char buf[VI_LINE_MAX];
 
 	/* Check indexes of minimum and maximum in the array. */
@@ -2562,27 +5494,31 @@ void vi_print_monthday_map_report(FILE *fp, struct vih *vih) {
 	Output->print_bidimentional_map(fp, 31, 12, xlabel, ylabel, md);
 
 	/* do sizes now */
-	md = (int*) vih->monthday_size;
+	size = &vih->monthday_size[0][0];
 	minj = 0, maxj = 0;
 	
 	/* Check indexes of minimum and maximum in the array. */
 	for (j = 0; j < 12*31; j++) {
-		if (md[j] > md[maxj])
+		if (size[j] > size[maxj])
 			maxj = j;
-		if (md[j] != 0 && (md[j] < md[minj] || md[minj] == 0))
+		if (size[j] != 0 && (size[j] < size[minj] || size[minj] == 0))
 			minj = j;
 	}
+	/* The map is drawn from the sizes in the unit of the maximum */
+	unit = vi_size_unit(size[maxj]);
+	for (j = 0; j < 12*31; j++)
+		map[j] = vi_size_scale(size[j], unit);
 
 	Output->print_title(fp, "Month-Day combined map");
 	Output->print_subtitle(fp, "Brighter means higher level of traffic");
-	snprintf(buf, VI_LINE_MAX, "Day with max traffic is %s %s with size",
-	         ylabel[maxj/31], xlabel[maxj%31]);
-	Output->print_numkey_info(fp, buf, md[maxj]);
-	snprintf(buf, VI_LINE_MAX, "Day with min traffic is %s %s with size",
-	         ylabel[minj/31], xlabel[minj%31]);
-	Output->print_numkey_info(fp, buf, md[minj]);
+	snprintf(buf, VI_LINE_MAX, "Day with max traffic is %s %s with size in %s",
+	         ylabel[maxj/31], xlabel[maxj%31], vi_size_units[unit]);
+	Output->print_numkey_info(fp, buf, map[maxj]);
+	snprintf(buf, VI_LINE_MAX, "Day with min traffic is %s %s with size in %s",
+	         ylabel[minj/31], xlabel[minj%31], vi_size_units[unit]);
+	Output->print_numkey_info(fp, buf, map[minj]);
 	Output->print_hline(fp);
-	Output->print_bidimentional_map(fp, 31, 12, xlabel, ylabel, md);
+	Output->print_bidimentional_map(fp, 31, 12, xlabel, ylabel, map);
 }
 
 void vi_print_hline(FILE *fp) {
@@ -2654,6 +5590,10 @@ int vi_print_report(char *of, struct vih *vih) {
 		vi_print_verbs_report(fp, vih);
 		vi_print_hline(fp);
 	}
+	if (Config_process_cache) {
+		vi_print_cache_report(fp, vih);
+		vi_print_hline(fp);
+	}
 	if (Config_process_error404) {
 		vi_print_error404_report(fp, vih);
 		vi_print_hline(fp);
@@ -2685,18 +5625,159 @@ int vi_print_report(char *of, struct vih *vih) {
 }
 
 /* -------------------------------- stream mode ----------------------------- */
-void vi_stream_mode(struct vih *vih) {
+#ifdef VI_HAVE_POLL
+/* Process the complete lines of the 'used' bytes read in 'buf', and move
+ * the last partial line at the start of the buffer. If 'flush' is true
+ * the partial line is processed too. A full buffer without newlines is
+ * a line too long: it is counted, and '*skip' is set to drop the rest of
+ * it, up to the next newline, from the data read later.
+ * Returns the number of bytes left in the buffer. */
+size_t vi_stream_lines(struct vih *vih, char *buf, size_t used, int flush,
+                       int *skip) {
+	size_t len;
+	char *nl;
+
+	if (*skip) {
+		if ((nl = memchr(buf, '\n', used)) == NULL) return 0;
+		*skip = 0;
+		len = nl-buf+1;
+		memmove(buf, buf+len, used-len);
+		used -= len;
+	}
+	for (len = used; len > 0 && buf[len-1] != '\n'; len--);
+	if (len == 0 && used == VI_STREAM_BUFLEN) {
+		vi_long_line(vih);
+		*skip = 1;
+		return 0;
+	}
+	if (flush) len = used;
+	if (len == 0) return used;
+	if (vi_scan_buffer(vih, buf, len))
+		fprintf(stderr, "%s\n", vi_get_error(vih));
+	memmove(buf, buf+len, used-len);
+	return used-len;
+}
+
+/* Follow mode callback: process a block of new lines of a followed file */
+int vi_follow_scan(void *privdata, char *buf, size_t len) {
+	return vi_scan_buffer(privdata, buf, len);
+}
+
+/* Stream mode: the standard input is read in big batches as soon as data
+ * is available, processing all the complete lines of every batch at once.
+ * The loop waits in poll() up to the next timer, so the report is updated
+ * and the statistics reset on schedule even when no input arrives. At the
+ * end of the input the read is tried again every second if the standard
+ * input is a regular file, so that a file redirected to the standard
+ * input can be followed like with tail -f (such a read never blocks).
+ * The end of a pipe or terminal is final: from then on the loop just
+ * waits for the timers.
+ *
+ * In follow mode ('follow' not NULL) the same loop waits for the inotify
+ * events of the followed files too, and processes their new lines. The
+ * standard input is read only if the stream mode is enabled as well. */
+void vi_stream_mode(struct vih *vih, struct vi_follow *follow) {
+	double lastupdate_t, lastreset_t, now_t, next_t;
+	char *buf;
+	size_t used = 0;
+	int eof = !Config_stream_mode, retry = 0, skip = 0;
+	struct stat sb;
+
+	if ((buf = malloc(VI_STREAM_BUFLEN)) == NULL) {
+		fprintf(stderr, "Out of memory allocating the stream buffer\n");
+		exit(1);
+	}
+	if (Config_stream_mode && fstat(0, &sb) == 0 && S_ISREG(sb.st_mode))
+		retry = 1;
+	/* Lines appended to the followed files since the scan */
+	if (follow && vi_follow_read(follow, vi_follow_scan, vih))
+		fprintf(stderr, "%s\n", vi_get_error(vih));
+	lastupdate_t = lastreset_t = vi_clock();
+	while(1) {
+		struct pollfd pfd[2];
+		int i, timeout, nfds = 0, in = -1, notify = -1, polling;
+
+		/* Without inotify the files are checked every second */
+		polling = follow && vi_follow_fd(follow) == -1;
+		/* Wait for input until the next timer */
+		now_t = vi_clock();
+		next_t = lastupdate_t + Config_update_every;
+		if (Config_reset_every && lastreset_t + Config_reset_every < next_t)
+			next_t = lastreset_t + Config_reset_every;
+		if (((eof && retry) || polling) && now_t + 1 < next_t)
+			next_t = now_t + 1;
+		if (next_t > now_t + 3600)
+			next_t = now_t + 3600;
+		timeout = next_t > now_t ? (int)((next_t - now_t)*1000)+1 : 0;
+		if (!eof) {
+			pfd[nfds].fd = 0;
+			in = nfds++;
+		}
+		if (follow && !polling) {
+			pfd[nfds].fd = vi_follow_fd(follow);
+			notify = nfds++;
+		}
+		for (i = 0; i < nfds; i++) {
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+		if (poll(pfd, nfds, timeout) == -1 && errno != EINTR) {
+			perror("poll");
+			exit(1);
+		}
+		if ((eof && retry) || (in != -1 && pfd[in].revents)) {
+			ssize_t n = read(0, buf+used, VI_STREAM_BUFLEN-used);
+
+			if (n > 0) {
+				used = vi_stream_lines(vih, buf, used+n, 0,
+				                       &skip);
+				eof = 0;
+			} else if (n == 0 ||
+			           (errno != EINTR && errno != EAGAIN)) {
+				/* A last line without newline is complete */
+				if (used)
+					used = vi_stream_lines(vih, buf, used, 1,
+					                       &skip);
+				eof = 1;
+			}
+		}
+		if (polling || (notify != -1 && pfd[notify].revents)) {
+			if (vi_follow_read(follow, vi_follow_scan, vih))
+				fprintf(stderr, "%s\n", vi_get_error(vih));
+		}
+		now_t = vi_clock();
+		/* update */
+		if ((now_t - lastupdate_t) >= Config_update_every) {
+			lastupdate_t = now_t;
+			if (vi_print_report(Config_output_file, vih)) {
+				fprintf(stderr, "%s\n", vi_get_error(vih));
+			}
+		}
+		/* reset */
+		if (Config_reset_every &&
+		        ((now_t - lastreset_t) >= Config_reset_every)) {
+			lastreset_t = now_t;
+			vi_reset(vih);
+		}
+	}
+}
+#else
+void vi_stream_mode(struct vih *vih, struct vi_follow *follow) {
 	time_t lastupdate_t, lastreset_t, now_t;
 
+	(void) follow; /* the follow mode needs poll() */
 	lastupdate_t = lastreset_t = time(NULL);
 	while(1) {
 		char buf[VI_LINE_MAX];
+		int toolong;
 
-		if (fgets(buf, VI_LINE_MAX, stdin) == NULL) {
+		if (vi_fgets(buf, stdin, &toolong) == NULL) {
 			vi_sleep(1);
 			continue;
 		}
-		if (vi_process_line(vih, buf)) {
+		if (toolong)
+			vi_long_line(vih);
+		else if (vi_process_line(vih, buf, strlen(buf))) {
 			fprintf(stderr, "%s\n", vi_get_error(vih));
 		}
 		now_t = time(NULL);
@@ -2715,11 +5796,12 @@ void vi_stream_mode(struct vih *vih) {
 		}
 	}
 }
+#endif
 
 /* ----------------------------------- main --------------------------------- */
 
 /* command line switche IDs */
-enum { OPT_USERS, OPT_MAXPAGES, OPT_MAXTYPES, OPT_CODES, OPT_ALL, OPT_MAXLINES, OPT_SITES, OPT_TYPES, OPT_HOSTS, OPT_MAXHOSTS, OPT_OUTPUT, OPT_VERSION, OPT_HELP, OPT_PREFIX, OPT_MAXCODES, OPT_MAXSITES, OPT_WEEKDAYHOUR_MAP, OPT_MONTHDAY_MAP, OPT_TAIL, OPT_STREAM, OPT_OUTPUTFILE, OPT_UPDATEEVERY, OPT_RESETEVERY, OPT_ERROR404, OPT_MAXERROR404, OPT_TIMEDELTA, OPT_GREP, OPT_EXCLUDE, OPT_IGNORE404, OPT_DEBUG};
+enum { OPT_USERS, OPT_MAXPAGES, OPT_MAXTYPES, OPT_CODES, OPT_ALL, OPT_MAXLINES, OPT_SITES, OPT_TYPES, OPT_HOSTS, OPT_MAXHOSTS, OPT_OUTPUT, OPT_VERSION, OPT_HELP, OPT_PREFIX, OPT_MAXCODES, OPT_MAXSITES, OPT_WEEKDAYHOUR_MAP, OPT_MONTHDAY_MAP, OPT_TAIL, OPT_STREAM, OPT_OUTPUTFILE, OPT_UPDATEEVERY, OPT_RESETEVERY, OPT_ERROR404, OPT_MAXERROR404, OPT_TIMEDELTA, OPT_GREP, OPT_EXCLUDE, OPT_IGNORE404, OPT_DEBUG, OPT_THREADS, OPT_INDEX, OPT_FOLLOW, OPT_STATE, OPT_SAVE, OPT_LOAD, OPT_MERGE, OPT_LOGFORMAT, OPT_CACHE};
 
 /* command line switches definition:
  * the rule with short options is to take upper case the
@@ -2752,8 +5834,17 @@ static struct ago_optlist visited_optlist[] = {
 	{ 'o',  "output",		OPT_OUTPUT,		AGO_NEEDARG},
 	{ 'v',  "version",		OPT_VERSION,		AGO_NOARG},
 	{ '\0', "tail",			OPT_TAIL,		AGO_NOARG},
+	{ '\0', "follow",		OPT_FOLLOW,		AGO_NOARG},
+	{ '\0', "state",		OPT_STATE,		AGO_NEEDARG},
+	{ '\0', "save",			OPT_SAVE,		AGO_NEEDARG},
+	{ '\0', "load",			OPT_LOAD,		AGO_NEEDARG},
+	{ '\0', "merge",		OPT_MERGE,		AGO_NOARG},
+	{ '\0', "log-format",		OPT_LOGFORMAT,		AGO_NEEDARG},
+	{ '\0', "cache",		OPT_CACHE,		AGO_NOARG},
 	{ '\0', "time-delta",		OPT_TIMEDELTA,		AGO_NEEDARG},
 	{ '\0', "ignore-404",           OPT_IGNORE404,          AGO_NOARG},
+	{ '\0', "threads",		OPT_THREADS,		AGO_NEEDARG},
+	{ '\0', "index",		OPT_INDEX,		AGO_NOARG},
 	{ 'd',	"debug",		OPT_DEBUG,		AGO_NOARG},
 	{ 'h',	"help",			OPT_HELP,		AGO_NOARG},
 	AGO_LIST_TERM
@@ -2780,9 +5871,29 @@ void visited_show_help(void) {
 	       "Visitors is Copyright(C) 2004-2006 Salvatore Sanfilippo <antirez@invece.org>\n");
 }
 
+/* Seed the hash function of the tables with a random secret, so that
+ * keys crafted to collide in the log lines (the requested pages and the
+ * user agents are chosen by the clients) can't be computed offline. The
+ * time and the pid are used where /dev/urandom is not available. */
+void vi_hash_seed(void) {
+	u_int32_t secret = 0;
+	FILE *fp;
+
+	if ((fp = fopen("/dev/urandom", "rb")) == NULL ||
+	    fread(&secret, sizeof(secret), 1, fp) != 1) {
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		secret = tv.tv_sec ^ (tv.tv_usec << 12) ^ ((u_int32_t)getpid() << 20);
+	}
+	if (fp) fclose(fp);
+	ht_set_strong_hash_init_val(secret);
+}
+
 int main(int argc, char **argv) {
 	int i, o;
 	struct vih *vih;
+	long long *offsets = NULL;	/* where the scan of every file ended */
 	char *filenames[VI_FILENAMES_MAX];
 	int filenamec = 0;
 
@@ -2918,6 +6029,45 @@ int main(int argc, char **argv) {
 		case OPT_DEBUG:
 			Config_debug = 1;
 			break;
+		case OPT_THREADS:
+			Config_threads = atoi(ago_optarg);
+			if (Config_threads < 1 || Config_threads > VI_THREADS_MAX) {
+				fprintf(stderr, "--threads must be between 1 and %d\n",
+				        VI_THREADS_MAX);
+				exit(1);
+			}
+			break;
+		case OPT_INDEX:
+			Config_index = 1;
+			break;
+		case OPT_FOLLOW:
+			Config_follow_mode = 1;
+			break;
+		case OPT_STATE:
+			Config_state_file = ago_optarg;
+			break;
+		case OPT_SAVE:
+			Config_save_file = ago_optarg;
+			break;
+		case OPT_LOAD:
+			Config_load_file = ago_optarg;
+			break;
+		case OPT_MERGE:
+			Config_merge_mode = 1;
+			break;
+		case OPT_LOGFORMAT: {
+			char *err;
+
+			Config_log_format = vi_logformat_compile(ago_optarg, &err);
+			if (Config_log_format == NULL) {
+				fprintf(stderr, "%s\n", err);
+				exit(1);
+			}
+		}
+		break;
+		case OPT_CACHE:
+			Config_process_cache = 1;
+			break;
 		case AGO_ALONE:
 			if (filenamec < VI_FILENAMES_MAX)
 				filenames[filenamec++] = ago_optarg;
@@ -2931,7 +6081,7 @@ int main(int argc, char **argv) {
 		return 0;
 	}
 	/* Check if at least one file was specified */
-	if (filenamec == 0 && !Config_stream_mode) {
+	if (filenamec == 0 && !Config_stream_mode && !Config_load_file) {
 		fprintf(stderr, "No logfile specified\n");
 		visited_show_help();
 		exit(1);
@@ -2941,32 +6091,122 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "--stream requires --output-file\n");
 		exit(1);
 	}
+	/* Snapshots can't be followed or processed incrementally. */
+	if (Config_merge_mode && (Config_state_file || Config_follow_mode)) {
+		fprintf(stderr, "--merge can't be used with --state or --follow\n");
+		exit(1);
+	}
+	/* The same for the follow mode, that is based on stream mode. */
+	if (Config_follow_mode && Config_output_file == NULL) {
+		fprintf(stderr, "--follow requires --output-file\n");
+		exit(1);
+	}
+#ifndef VI_HAVE_THREADS
+	if (Config_state_file) {
+		fprintf(stderr, "--state is not supported on this system: "
+		        "it needs the threaded scanner\n");
+		exit(1);
+	}
+#endif
+#ifndef VI_HAVE_POLL
+	if (Config_follow_mode) {
+		fprintf(stderr, "--follow is not supported on this system\n");
+		exit(1);
+	}
+#endif
 	/* Set the default output module */
 	if (Output == NULL)
 		Output = &OutputModuleHtml;
+	/* Set the line parser */
+	Parser = Config_log_format ? Config_log_format->parser : vi_parse_line;
+	/* Only squid logs have the cache reports data */
+	if (Parser == vi_parse_squid)
+		Config_process_cache = 1;
 	/* Change to "C" locale for date/time related functions */
 	setlocale(LC_ALL, "C");
+	/* Select the line parsing kernel for this CPU */
+	vi_delim_setup();
+	vi_hash_seed();
+	if (Config_debug)
+		fprintf(stderr, "Delimiter search: %s\n", vi_delim_kernel_name());
 	/* Process all the log files specified. */
 	vih = vi_new();
+	if (Config_load_file && vi_snapshot_load(vih, Config_load_file)) {
+		fprintf(stderr, "%s: %s\n", Config_load_file, vi_get_error(vih));
+		exit(1);
+	}
+	if (Config_merge_mode) {
+		if (vi_merge_snapshots(vih, filenames, filenamec, Config_threads)) {
+			fprintf(stderr, "%s\n", vi_get_error(vih));
+			exit(1);
+		}
+	} else
+#ifdef VI_HAVE_THREADS
+	if (Config_state_file) {
+		if ((offsets = calloc(filenamec+1, sizeof(long long))) == NULL ||
+		    vi_state_scan(vih, Config_state_file, filenames, filenamec,
+		                  offsets)) {
+			fprintf(stderr, "%s\n", offsets ? vi_get_error(vih) :
+			        "Out of memory loading the state");
+			exit(1);
+		}
+	} else if (Config_threads > 1 || Config_follow_mode) {
+		/* The follow mode needs to know where the scan of every file
+		 * ended, to continue from there. */
+		if (Config_follow_mode &&
+		    (offsets = calloc(filenamec+1, sizeof(long long))) == NULL) {
+			fprintf(stderr, "Out of memory starting the follow mode\n");
+			exit(1);
+		}
+		if (vi_scan_files(vih, filenames, filenamec, Config_threads,
+		                  offsets, NULL)) {
+			fprintf(stderr, "%s\n", vi_get_error(vih));
+			exit(1);
+		}
+	} else
+#endif
 	for (i = 0; i < filenamec; i++) {
 		if (vi_scan(vih, filenames[i])) {
 			fprintf(stderr, "%s: %s\n", filenames[i], vi_get_error(vih));
 			exit(1);
 		}
 	}
+	if (Config_save_file && vi_snapshot_save(vih, Config_save_file)) {
+		fprintf(stderr, "%s: %s\n", Config_save_file, vi_get_error(vih));
+		exit(1);
+	}
 	if (vi_print_report(Config_output_file, vih)) {
 		fprintf(stderr, "%s\n", vi_get_error(vih));
 		exit(1);
 	}
-	if (Config_stream_mode) {
-		vi_stream_mode(vih);
+	if (Config_stream_mode || Config_follow_mode) {
+		struct vi_follow *follow = NULL;
+
+		if (Config_follow_mode) {
+			char *followv[VI_FILENAMES_MAX];
+			long long followo[VI_FILENAMES_MAX];
+			int followc = 0;
+
+			/* Follow the plain files, from where the scan ended */
+			for (i = 0; i < filenamec; i++) {
+				if (strcmp(filenames[i], "-") &&
+				    vi_file_compression(filenames[i]) == VI_COMP_NONE) {
+					followo[followc] = offsets ? offsets[i] : -1;
+					followv[followc++] = filenames[i];
+				}
+			}
+			if ((follow = vi_follow_new(followc, followv,
+			                            followo)) == NULL) {
+				fprintf(stderr, "Out of memory starting the follow mode\n");
+				exit(1);
+			}
+		}
+		vi_stream_mode(vih, follow);
 	}
+	free(offsets);
 	vi_print_statistics(vih);
-	/* The following is commented in releases as to free the hashtable
-	 * memory is very slow, it's better to just exit the program.
-	 * Still it is important to be able to re-enable a good cleanup
-	 * in order to run visitors against valgrind to check for memory
-	 * leaks. */
-	/* vi_free(vih); */
+	/* The keys are released a chunk at a time, so this is cheap even
+	 * after millions of them. */
+	vi_free(vih);
 	return 0;
 }